@@ -0,0 +1,211 @@
+// Micro-benchmarks for the pixel and text kernels.
+// Usage: ttyapple_bench [filter], only benchmarks with filter in their name are run
+//        ttyapple_bench --pipeline [frames], times decoding and drawing a generated video
+
+#include "pipeline.h"
+
+#include "../c_writer.h"
+#include "../image.h"
+#include "../output.h"
+#include "../stream_context.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libswscale/swscale.h>
+}
+
+// Each benchmark runs for at least this long
+#define BENCH_MIN_TIME std::chrono::milliseconds(250)
+
+// Sources for scaling are this many times bigger than the output
+#define BENCH_SOURCE_SCALE 4
+
+// Length of the video generated for the pipeline benchmark
+#define BENCH_PIPELINE_FRAMES 600
+
+struct BenchSize {
+    int width;
+    int height;
+};
+
+static const BenchSize sizes[] = {
+    {80, 48},
+    {200, 100},
+    {400, 200},
+};
+
+// Stops the compiler from optimising away results
+static inline void keep(const void* p) {
+    asm volatile("" : : "r"(p) : "memory");
+}
+
+// Something like a frame of the video, a white blob on black with some noise
+static std::vector<uint8_t> make_frame(int width, int height) {
+    std::vector<uint8_t> frame(width * height);
+
+    uint32_t seed = 1;
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            int dx = x - width / 2;
+            int dy = (y - height / 2) * 2;
+            uint8_t value = (dx * dx + dy * dy < width * width / 9) ? 0xf0 : 0x10;
+
+            seed = seed * 1103515245 + 12345;
+            frame[y * width + x] = value ^ ((seed >> 16) & 0x3f);
+        }
+    }
+
+    return frame;
+}
+
+// Runs fn repeatedly and reports the time per call,
+// bytes is how much data fn processes each call
+static void run_bench(const char* filter, const std::string& name, size_t bytes, const std::function<void()>& fn) {
+    if(filter && name.find(filter) == std::string::npos) {
+        return;
+    }
+
+    // Warm up caches and anything allocated on first use
+    fn();
+
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = start - start;
+    long iterations = 0;
+    long batch = 1;
+    while(elapsed < BENCH_MIN_TIME) {
+        for(long i = 0; i < batch; i++) {
+            fn();
+        }
+
+        iterations += batch;
+        batch *= 2;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    printf("%-40s %12.0f ns/frame %10.1f MB/s %10zu bytes/frame\n", name.c_str(), ns, bytes / ns * 1000, bytes);
+    fflush(stdout);
+}
+
+static void bench_size(const char* filter, BenchSize size) {
+    int width = size.width;
+    int height = size.height;
+    std::string suffix = fmt::format("/{}x{}", width, height);
+
+    std::vector<uint8_t> frame = make_frame(width, height);
+
+    std::vector<std::vector<char>> rows(height / 2);
+    for(int i = 0; i < height; i += 2) {
+        frame_data_to_string(frame.data() + i * width, frame.data() + (i + 1) * width, width, rows[i / 2]);
+    }
+
+    size_t textSize = 0;
+    for(const auto& row : rows) {
+        textSize += row.size() - 1;
+    }
+
+    run_bench(filter, "frame_data_to_string" + suffix, textSize, [&]{
+        for(int i = 0; i < height; i += 2) {
+            auto& row = rows[i / 2];
+            row.clear();
+            frame_data_to_string(frame.data() + i * width, frame.data() + (i + 1) * width, width, row);
+        }
+        keep(rows.data());
+    });
+
+    // Frames are written to /dev/null rather than the terminal
+    FILE* null = fopen("/dev/null", "wb");
+
+    // Clear sequence, then each row and a newline
+    run_bench(filter, "print_frame_data" + suffix, textSize + rows.size() + 3, [&]{
+        print_frame_data(null, rows);
+    });
+
+    int stride = (width + 7) / 8;
+    std::vector<uint8_t> packed(stride * height);
+    run_bench(filter, "pack_monochrome_pxls" + suffix, width * height, [&]{
+        for(int i = 0; i < height; i++) {
+            pack_monochrome_pxls(packed.data() + i * stride, frame.data() + i * width, width);
+        }
+        keep(packed.data());
+    });
+
+    int sourceWidth = width * BENCH_SOURCE_SCALE;
+    int sourceHeight = height * BENCH_SOURCE_SCALE;
+    std::vector<uint8_t> source = make_frame(sourceWidth, sourceHeight);
+
+    std::vector<uint8_t*> sourceRows;
+    for(int i = 0; i < sourceHeight; i++) {
+        sourceRows.push_back(source.data() + i * sourceWidth);
+    }
+
+    run_bench(filter, "downscale_image" + suffix, width * height, [&]{
+        std::vector<uint8_t> scaled = downscale_image<uint8_t>(sourceRows.data(), sourceWidth, sourceHeight, width, height);
+        keep(scaled.data());
+    });
+
+    std::string array;
+    CWriter::format_u8_array(array, "frame0", packed.data(), packed.size());
+    run_bench(filter, "format_u8_array" + suffix, array.size(), [&]{
+        array.clear();
+        CWriter::format_u8_array(array, "frame0", packed.data(), packed.size());
+        keep(array.data());
+    });
+
+    CWriter writer;
+    writer.set_file(null);
+    run_bench(filter, "write_u8_array" + suffix, array.size(), [&]{
+        writer.write_u8_array("frame0", packed.data(), packed.size());
+    });
+    writer.flush();
+    fclose(null);
+
+    // Videos are usually YUV 4:2:0, use the same source for each plane
+    SwsContext* rescaler = sws_getContext(sourceWidth, sourceHeight, AV_PIX_FMT_YUV420P, width, height,
+                                          AV_PIX_FMT_GRAY8, StreamContext::rescaler_flags(), nullptr, nullptr, nullptr);
+    if(rescaler) {
+        const uint8_t* planes[3] = {source.data(), source.data(), source.data()};
+        int linesizes[3] = {sourceWidth, sourceWidth / 2, sourceWidth / 2};
+
+        std::vector<uint8_t> scaled(width * height);
+        uint8_t* outPlanes[1] = {scaled.data()};
+        int outLinesizes[1] = {width};
+
+        run_bench(filter, "sws_scale_gray8" + suffix, width * height, [&]{
+            sws_scale(rescaler, planes, linesizes, 0, sourceHeight, outPlanes, outLinesizes);
+            keep(scaled.data());
+        });
+
+        sws_freeContext(rescaler);
+    }
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1 && !strcmp(argv[1], "--pipeline")) {
+        int frames = argc > 2 ? atoi(argv[2]) : BENCH_PIPELINE_FRAMES;
+        if(frames <= 0) {
+            fprintf(stderr, "Invalid frame count '%s'\n", argv[2]);
+            return 1;
+        }
+
+        return run_pipeline_bench(frames);
+    }
+
+    const char* filter = argc > 1 ? argv[1] : nullptr;
+
+    for(BenchSize size : sizes) {
+        bench_size(filter, size);
+    }
+
+    return 0;
+}
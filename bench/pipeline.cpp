@@ -0,0 +1,320 @@
+#include "pipeline.h"
+
+#include "../frame.h"
+#include "../logger.h"
+#include "../output.h"
+#include "../stream_context.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+#include <unistd.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/frame.h>
+}
+
+// Size and rate of the generated video, the same as the original Bad Apple
+#define SYNTHETIC_WIDTH 480
+#define SYNTHETIC_HEIGHT 360
+#define SYNTHETIC_FPS 30
+
+using Clock = std::chrono::steady_clock;
+
+static double to_us(Clock::duration duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+// Sends encoded packets to the file until the encoder wants more input
+static int write_packets(AVFormatContext* format, AVStream* stream, AVCodecContext* encoder, AVPacket* packet) {
+    int ret;
+    while((ret = avcodec_receive_packet(encoder, packet)) == 0) {
+        av_packet_rescale_ts(packet, encoder->time_base, stream->time_base);
+        packet->stream_index = stream->index;
+
+        if((ret = av_interleaved_write_frame(format, packet)) < 0) {
+            return ret;
+        }
+    }
+
+    return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+}
+
+// Draws frame index of the test pattern, a white circle moving around
+// a black screen with a smaller one orbiting it so every frame changes
+static void draw_pattern(AVFrame* frame, int index) {
+    // Positions follow a triangle wave so they stay deterministic
+    auto bounce = [](int t, int range) { t %= range * 2; return t < range ? t : range * 2 - t; };
+
+    int radius = SYNTHETIC_HEIGHT / 4;
+    int cx = radius + bounce(index * 4, SYNTHETIC_WIDTH - radius * 2);
+    int cy = radius + bounce(index * 3, SYNTHETIC_HEIGHT - radius * 2);
+
+    int smallRadius = radius / 3;
+    int sx = cx + bounce(index * 9, radius * 4) - radius * 2;
+    int sy = cy - radius - smallRadius;
+
+    for(int y = 0; y < SYNTHETIC_HEIGHT; y++) {
+        uint8_t* row = frame->data[0] + y * frame->linesize[0];
+        for(int x = 0; x < SYNTHETIC_WIDTH; x++) {
+            int dx = x - cx, dy = y - cy;
+            int sdx = x - sx, sdy = y - sy;
+
+            bool white = dx * dx + dy * dy < radius * radius
+                || sdx * sdx + sdy * sdy < smallRadius * smallRadius;
+            row[x] = white ? 235 : 16;
+        }
+    }
+
+    // No colour
+    for(int plane = 1; plane < 3; plane++) {
+        for(int y = 0; y < SYNTHETIC_HEIGHT / 2; y++) {
+            memset(frame->data[plane] + y * frame->linesize[plane], 128, SYNTHETIC_WIDTH / 2);
+        }
+    }
+}
+
+// Encodes frameCount frames of the test pattern as MPEG-4 part 2 in Matroska,
+// both are built into every libav so this works anywhere. Returns 0 on success
+static int generate_video(const char* path, int frameCount) {
+    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    if(!codec) {
+        Logger::Error("No MPEG-4 encoder!");
+        return 1;
+    }
+
+    AVFormatContext* format = nullptr;
+    if(avformat_alloc_output_context2(&format, nullptr, "matroska", path) < 0) {
+        Logger::Error("Failed to create output context!");
+        return 1;
+    }
+
+    AVStream* stream = avformat_new_stream(format, nullptr);
+    AVCodecContext* encoder = avcodec_alloc_context3(codec);
+
+    encoder->width = SYNTHETIC_WIDTH;
+    encoder->height = SYNTHETIC_HEIGHT;
+    encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+    encoder->time_base = {1, SYNTHETIC_FPS};
+    encoder->framerate = {SYNTHETIC_FPS, 1};
+    encoder->gop_size = SYNTHETIC_FPS;
+    encoder->bit_rate = 1000000;
+    // Threaded encoding could change the output between runs
+    encoder->thread_count = 1;
+
+    if(format->oformat->flags & AVFMT_GLOBALHEADER) {
+        encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    AVFrame* frame = av_frame_alloc();
+    AVPacket* packet = av_packet_alloc();
+
+    int ret = avcodec_open2(encoder, codec, nullptr);
+    if(ret >= 0) {
+        ret = avcodec_parameters_from_context(stream->codecpar, encoder);
+        stream->time_base = encoder->time_base;
+    }
+
+    if(ret >= 0) {
+        ret = avio_open(&format->pb, path, AVIO_FLAG_WRITE);
+    }
+
+    if(ret >= 0) {
+        ret = avformat_write_header(format, nullptr);
+    }
+
+    if(ret >= 0) {
+        frame->format = encoder->pix_fmt;
+        frame->width = encoder->width;
+        frame->height = encoder->height;
+        ret = av_frame_get_buffer(frame, 0);
+    }
+
+    for(int i = 0; i < frameCount && ret >= 0; i++) {
+        ret = av_frame_make_writable(frame);
+        if(ret < 0) {
+            break;
+        }
+
+        draw_pattern(frame, i);
+        frame->pts = i;
+
+        ret = avcodec_send_frame(encoder, frame);
+        if(ret >= 0) {
+            ret = write_packets(format, stream, encoder, packet);
+        }
+    }
+
+    // Flush the encoder
+    if(ret >= 0) {
+        ret = avcodec_send_frame(encoder, nullptr);
+    }
+
+    if(ret >= 0) {
+        ret = write_packets(format, stream, encoder, packet);
+    }
+
+    if(ret >= 0) {
+        ret = av_write_trailer(format);
+    }
+
+    if(ret < 0) {
+        char error[128];
+        av_strerror(ret, error, sizeof(error));
+        Logger::Error("Failed to generate test video: {}", error);
+    }
+
+    if(format->pb) {
+        avio_closep(&format->pb);
+    }
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&encoder);
+    avformat_free_context(format);
+
+    return ret < 0;
+}
+
+// Time spent by each side of the pipeline
+struct PipelineStats {
+    int framesDecoded = 0;
+    int framesRendered = 0;
+
+    // Decoder thread waiting for the output to take or give back a frame
+    Clock::duration decoderWait{};
+    // Output spent drawing frames
+    Clock::duration renderTime{};
+
+    size_t bytes = 0;
+};
+
+static PipelineStats stats;
+
+// Counts how long run spends on frames rather than waiting for them
+class PipelineOutput : public TTYOutput {
+public:
+    using TTYOutput::TTYOutput;
+
+    void run() override {
+        std::unique_lock lock{m_frameLock};
+        bool pending = m_nextFrame != nullptr;
+        lock.unlock();
+
+        auto start = Clock::now();
+        TTYOutput::run();
+
+        if(pending) {
+            stats.renderTime += Clock::now() - start;
+            stats.framesRendered++;
+        }
+    }
+};
+
+static PipelineOutput* output;
+
+static FrameHandle acquire_frame() {
+    auto start = Clock::now();
+    FrameHandle frame = output->acquire_frame();
+    stats.decoderWait += Clock::now() - start;
+
+    return frame;
+}
+
+static void push_frame(FrameHandle frame) {
+    auto start = Clock::now();
+    output->send_frame(std::move(frame));
+    stats.decoderWait += Clock::now() - start;
+
+    stats.framesDecoded++;
+}
+
+// Throws away anything written, only counting the bytes
+static ssize_t count_bytes(void* cookie, const char*, size_t size) {
+    *(size_t*)cookie += size;
+    return size;
+}
+
+int run_pipeline_bench(int frameCount) {
+    char path[] = "/tmp/ttyapple-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0) {
+        Logger::Error("Failed to create temporary file: {}!", strerror(errno));
+        return 1;
+    }
+    close(fd);
+
+    if(generate_video(path, frameCount)) {
+        unlink(path);
+        return 1;
+    }
+
+    static const int sizes[][2] = {
+        {80, 48},
+        {200, 100},
+        {400, 200},
+    };
+
+    for(const auto& [width, height] : sizes) {
+        stats = PipelineStats();
+
+        cookie_io_functions_t sinkFunctions = {nullptr, count_bytes, nullptr, nullptr};
+        FILE* sink = fopencookie(&stats.bytes, "w", sinkFunctions);
+
+        output = new PipelineOutput(width, height);
+        output->set_file(sink);
+        output->set_pacing(false);
+
+        auto start = Clock::now();
+        {
+            StreamContext decoder;
+            decoder.acquire_buffer = acquire_frame;
+            decoder.push_buffer = push_frame;
+
+            decoder.set_output_format(width, height);
+            if(decoder.play_track(path)) {
+                unlink(path);
+                return 1;
+            }
+
+            while(decoder.is_playing()) {
+                output->run();
+            }
+
+            // Draw the last frame which may have been sent as the decoder stopped
+            output->run();
+        }
+        auto elapsed = Clock::now() - start;
+
+        output->finish();
+        delete output;
+        fclose(sink);
+
+        int frames = stats.framesRendered;
+        double total = to_us(elapsed);
+        double decoding = total - to_us(stats.decoderWait);
+        double rendering = to_us(stats.renderTime);
+
+        std::string name = fmt::format("pipeline/{}x{}", width, height);
+        printf("%-40s %d frames in %.1f ms, %.0f fps\n", name.c_str(), frames, total / 1000, frames / total * 1000000);
+        printf("    decode %10.0f fps, %8.1f us/frame waiting on the output\n",
+                stats.framesDecoded / decoding * 1000000, to_us(stats.decoderWait) / std::max(stats.framesDecoded, 1));
+        printf("    render %10.0f fps, %8.1f us/frame waiting on the decoder\n",
+                frames / rendering * 1000000, (total - rendering) / std::max(frames, 1));
+        printf("    %zu bytes/frame\n", stats.bytes / std::max(frames, 1));
+        fflush(stdout);
+    }
+
+    unlink(path);
+    return 0;
+}
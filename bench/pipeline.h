@@ -0,0 +1,6 @@
+#pragma once
+
+// Plays a generated video through the decoder and TTY output as fast as
+// possible at each benchmark size, writing the frames nowhere.
+// Returns 0 on success
+int run_pipeline_bench(int frameCount);
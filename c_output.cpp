@@ -1,60 +1,29 @@
 #include "output.h"
 
 #include "frame.h"
+#include "frame_encoding.h"
 #include "image.h"
 #include "logger.h"
+#include "paths.h"
+#include "stats.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 
+#include <filesystem>
 #include <string>
+#include <string_view>
 #include <vector>
 
-// Max characters per line
-#define GEN_C_LINE_MAX 80
+// Max frames waiting to be encoded or written for each encoder thread
+#define ENCODE_JOBS_PER_WORKER 4
 
-std::string generate_c_array(const std::string& type, const std::string& name,
-                             const std::vector<std::string>& values) {
-    std::string result = fmt::format("{} {}[{}] = {{\n    ", type, name, values.size());
-    int length = 4;
-    for(const auto& v : values) {
-        // Wrap to the next line if necessary
-        // add 1 to the length to account for the comma
-        length += v.length();
-        if(length + 1 > GEN_C_LINE_MAX) {
-            length = 4 + v.length();
-            result += "\n    ";
-        }
-
-        result += v + ",";
-    }
-
-    result += "};\n";
-
-    return result;
-}
-
-std::string generate_c_array_u8(const std::string& name, uint8_t* values, unsigned count) {
-    std::string result = fmt::format("uint8_t {}[{}] = {{\n", name, count);
-    while(count > 16) {
-        // Since we are dealing with 8-bit ints,
-        // it will save a little more room to use decimal instead of hex
-        result += fmt::format("    {},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},\n",
-            values[0], values[1], values[2], values[3],
-            values[4], values[5], values[6], values[7],
-            values[8], values[9], values[10], values[11],
-            values[12], values[13], values[14], values[15]);
-
-        values += 16;
-        count -= 16;
-    }
-    while(count--) {
-        result += fmt::format("{},", *(values++));
-    }
-
-    result += "};\n";
-
-    return result;
-}
+// How far in microseconds the time between frames can be from the average
+// for the video to still be considered constant frame rate
+#define FRAME_INTERVAL_TOLERANCE 1000
 
 COutput::COutput(int width, int height)
     : Output(width, height) {
@@ -63,10 +32,25 @@ COutput::COutput(int width, int height)
     // rather than reallocating one every frame.
     // Pad each row to be a 8-pixel multiple
     m_packedPixelBuffer = new uint8_t[((width + 7) / 8) * height];
+
+    // Delta encoded frames are compared against the previous frame,
+    // or the previous frame with the same field when interlacing.
+    // The first frames are compared against a blank one
+    m_previousPackedBuffers[0] = new uint8_t[((width + 7) / 8) * height]();
+    m_previousPackedBuffers[1] = new uint8_t[((width + 7) / 8) * height]();
 }
 
 COutput::~COutput() {
+    stop_workers();
     close_file();
+
+    delete[] m_packedPixelBuffer;
+    delete[] m_previousPackedBuffers[0];
+    delete[] m_previousPackedBuffers[1];
+
+    if(m_uniqueData) {
+        fclose(m_uniqueData);
+    }
 }
 
 int COutput::open_file(const char* path) {
@@ -76,21 +60,262 @@ int COutput::open_file(const char* path) {
         return 1;
     }
 
-    fprintf(m_out, "#include <stdint.h>\n");
+    m_writer.set_file(m_out);
+    m_writer.write("#include <stdint.h>\n");
+
+    return 0;
+}
+
+void COutput::set_delta_encoding(bool enabled) {
+    assert(!m_frameIndex);
+    m_deltaEncoding = enabled;
+}
+
+void COutput::set_compression(FrameCompression compression) {
+    assert(!m_frameIndex);
+    m_compression = compression;
+}
+
+int COutput::set_frame_storage(FrameStorage storage, const char* blobPath) {
+    assert(!m_frameIndex);
+    assert(storage != FrameStorage::Pack);
+
+    m_storage = storage;
+    if(m_storage == FrameStorage::Array) {
+        return 0;
+    }
+
+    m_blobPath = blobPath;
+    if(m_storage == FrameStorage::Object) {
+        return m_object.open(blobPath);
+    }
+
+    m_blob = fopen(blobPath, "wb");
+    if(!m_blob) {
+        Logger::Error("Failed to open '{}' for writing!", blobPath);
+        return 1;
+    }
 
     return 0;
 }
 
 void COutput::close_file() {
     if(m_out) {
+        m_writer.flush();
+
         fclose(m_out);
         m_out = nullptr;
     }
+
+    if(m_blob) {
+        fclose(m_blob);
+        m_blob = nullptr;
+    }
 }
 
-void COutput::run() {
-    assert(m_out);
+unsigned COutput::pack_frame(const uint8_t* pixels, int index, uint8_t* packed) const {
+    int stride = (m_width + 7) / 8;
+
+    if(m_interlaced) {
+        // Each line of text is two rows of pixels,
+        // even frames have the even lines and odd frames the odd lines
+        int field = index % 2;
+        for(int i = 0; i < m_height / 4; i++) {
+            int row = (i * 2 + field) * 2;
+
+            // Each row is padded to 8-bits,
+            // so pack the pixels one row at a time
+            pack_monochrome_pxls(packed + (i * 2) * stride,
+                                pixels + row * m_width, m_width);
+            pack_monochrome_pxls(packed + (i * 2 + 1) * stride,
+                                pixels + (row + 1) * m_width, m_width);
+        }
+
+        return stride * m_height / 2;
+    }
+
+    for(int i = 0; i < m_height; i++) {
+        // Each row is padded to 8-bits,
+        // so pack the pixels one row at a time
+        pack_monochrome_pxls(packed + i * stride,
+                            pixels + i * m_width, m_width);
+    }
+
+    return stride * m_height;
+}
+
+int COutput::delta_reference(int index) const {
+    return m_interlaced ? index % 2 : 0;
+}
+
+bool COutput::is_keyframe(int index) const {
+    if(!m_keyframeInterval) {
+        return false;
+    }
+
+    // Both fields start over on the same frame
+    int fieldFrame = m_interlaced ? index / 2 : index;
+    return fieldFrame % m_keyframeInterval == 0;
+}
+
+void COutput::encode_packed(const uint8_t* packed, const uint8_t* previousPacked, unsigned size,
+                            std::vector<uint8_t>& out, std::vector<uint8_t>& deltaBuffer) const {
+    out.clear();
 
+    if(m_compression == FrameCompression::None) {
+        if(m_deltaEncoding) {
+            encode_delta(previousPacked, packed, size, out);
+        } else {
+            out.assign(packed, packed + size);
+        }
+        return;
+    }
+
+    const uint8_t* data = packed;
+    if(m_deltaEncoding) {
+        // The compressor deals with the unchanged runs itself,
+        // so just XOR the frames rather than encoding spans
+        deltaBuffer.resize(size);
+        for(unsigned i = 0; i < size; i++) {
+            deltaBuffer[i] = previousPacked[i] ^ packed[i];
+        }
+
+        data = deltaBuffer.data();
+    }
+
+    if(m_compression == FrameCompression::RLE) {
+        compress_rle(data, size, out);
+    } else {
+        compress_lz(data, size, out);
+    }
+}
+
+long COutput::find_duplicate_frame(const uint8_t* data, unsigned size, size_t index) {
+    uint64_t hash = hash_bytes(HASH_BYTES_INITIAL, std::string_view((const char*)data, size));
+
+    // Different frames can have the same hash, so compare the data
+    auto [begin, end] = m_uniqueFrames.equal_range(hash);
+    if(begin != end) {
+        std::vector<uint8_t> stored;
+        for(auto it = begin; it != end; it++) {
+            const UniqueFrame& frame = it->second;
+            if(frame.size != size) {
+                continue;
+            }
+
+            stored.resize(size);
+            if(fseek(m_uniqueData, frame.offset, SEEK_SET) || fread(stored.data(), 1, size, m_uniqueData) != size) {
+                Logger::Error("Error reading frame data: {}", strerror(errno));
+                std::terminate();
+            }
+
+            if(!memcmp(stored.data(), data, size)) {
+                return frame.index;
+            }
+        }
+    }
+
+    if(!m_uniqueData) {
+        m_uniqueData = tmpfile();
+        if(!m_uniqueData) {
+            Logger::Error("Failed to create temporary file: {}", strerror(errno));
+            std::terminate();
+        }
+    }
+
+    // Might have been reading from the middle
+    if(fseek(m_uniqueData, 0, SEEK_END) || fwrite(data, 1, size, m_uniqueData) != size) {
+        Logger::Error("Error writing frame data: {}", strerror(errno));
+        std::terminate();
+    }
+
+    m_uniqueFrames.emplace(hash, UniqueFrame{index, m_uniqueDataSize, size});
+    m_uniqueDataSize += size;
+    return -1;
+}
+
+void COutput::write_frame(int index, const uint8_t* data, unsigned size, const std::string* text) {
+    // Identical frames are only stored once
+    // and share an entry in the frames table
+    long duplicate = find_duplicate_frame(data, size, m_frameNames.size());
+    if(duplicate >= 0) {
+        m_frameNames.push_back(m_frameNames[duplicate]);
+        if(m_storage == FrameStorage::Object) {
+            m_frameOffsets.push_back(m_frameOffsets[duplicate]);
+        }
+        return;
+    }
+
+    if(m_storage == FrameStorage::Array) {
+        std::string name = fmt::format("frame{}", index);
+        CWriter& writer = frame_writer(index);
+        if(text) {
+            writer.write(*text);
+        } else {
+            writer.write_u8_array(name, data, size);
+        }
+
+        if(&writer != &m_writer) {
+            m_externFrames.push_back(name);
+        }
+
+        m_frameNames.push_back(std::move(name));
+        return;
+    }
+
+    if(m_storage == FrameStorage::Object) {
+        m_frameOffsets.push_back(m_object.write(data, size));
+        // Names are only used by the generated source
+        m_frameNames.emplace_back();
+        return;
+    }
+
+    assert(m_blob);
+    if(fwrite(data, 1, size, m_blob) != size) {
+        Logger::Error("Error writing '{}': {}", m_blobPath, strerror(errno));
+        std::terminate();
+    }
+
+    m_frameNames.push_back(fmt::format("frame_data+{}", m_blobSize));
+    m_blobSize += size;
+}
+
+void COutput::write_blob_include() {
+    // Relative paths would be looked up from wherever the source is compiled
+    std::error_code error;
+    std::string blobPath = std::filesystem::absolute(m_blobPath, error).string();
+    if(error) {
+        Logger::Warning("Failed to get the absolute path of '{}': {}", m_blobPath, error.message());
+        blobPath = m_blobPath;
+    }
+
+    // Escape the path so it can go in a string literal
+    std::string path;
+    for(char c : blobPath) {
+        if(c == '\\' || c == '"') {
+            path += '\\';
+        }
+        path += c;
+    }
+
+    if(m_storage == FrameStorage::Embed) {
+        m_writer.print("uint8_t frame_data[] = {{\n#embed \"{}\"\n}};\n", path);
+        return;
+    }
+
+    // Let the assembler pull the file straight into read-only data,
+    // the compiler never has to parse the frame data
+    m_writer.print("extern uint8_t frame_data[];\n\
+#if defined(_WIN32) || defined(UEFI)\n\
+#define FRAME_DATA_SECTION \".section .rdata,\\\"dr\\\"\\n\"\n\
+#else\n\
+#define FRAME_DATA_SECTION \".section .rodata\\n\"\n\
+#endif\n\
+__asm__(FRAME_DATA_SECTION \".globl frame_data\\n.balign 16\\nframe_data:\\n\"\n\
+    \".incbin \\\"{}\\\"\\n.text\\n\");\n", path);
+}
+
+void COutput::run() {
     std::unique_lock lock{m_frameLock};
     // TODO: Should probably figure out a clean way to use condition_variable
     // so this function doesn't hog the lock.
@@ -100,45 +325,33 @@ void COutput::run() {
         return;
     }
 
-    m_currentFrame = m_nextFrame;
-    m_nextFrame = nullptr;
+    m_currentFrame = std::move(m_nextFrame);
 
     lock.unlock();
     m_frameCondition.notify_all();
 
-    int stride = (m_width + 7) / 8;
+    m_frameTimestamps.push_back(m_currentFrame->usTimestamp);
 
-    std::string array;
-    if(m_interlaced) {
-        for(int i = (m_frameIndex % 2) * 2; i < m_height / 2; i += 2) {
-            // Each row is padded to 8-bits,
-            // so pack the pixels one row at a time
-            pack_monochrome_pxls(m_packedPixelBuffer + i * stride,
-                                m_currentFrame->data + (i * 2) * m_width, m_width);
-            pack_monochrome_pxls(m_packedPixelBuffer + (i + 1) * stride,
-                                m_currentFrame->data + (i * 2 + 1) * m_width, m_width);
+    if(m_workers.empty()) {
+        StageTimer convertTimer{Stage::Convert};
+        uint8_t*& previousPacked = m_previousPackedBuffers[delta_reference(m_frameIndex)];
+        if(is_keyframe(m_frameIndex)) {
+            memset(previousPacked, 0, ((m_width + 7) / 8) * m_height);
         }
 
-        array = generate_c_array_u8(fmt::format("frame{}", m_frameIndex),
-                                    m_packedPixelBuffer,
-                                    stride * m_height / 2);
-    } else {
-        for(int i = 0; i < m_height; i++) {
-            // Each row is padded to 8-bits,
-            // so pack the pixels one row at a time
-            pack_monochrome_pxls(m_packedPixelBuffer + i * stride,
-                                m_currentFrame->data + i * m_width, m_width);
-        }
-        array = generate_c_array_u8(fmt::format("frame{}", m_frameIndex),
-                                    m_packedPixelBuffer,
-                                    stride * m_height);
-    }
+        unsigned size = pack_frame(m_currentFrame->data, m_frameIndex, m_packedPixelBuffer);
+        encode_packed(m_packedPixelBuffer, previousPacked, size, m_encodedBuffer, m_deltaBuffer);
+        std::swap(previousPacked, m_packedPixelBuffer);
+        convertTimer.stop();
 
+        StageTimer writeTimer{Stage::Write};
+        write_frame(m_frameIndex, m_encodedBuffer.data(), m_encodedBuffer.size());
+        writeTimer.stop();
 
-    size_t written = fwrite(array.c_str(), 1, array.length(), m_out);
-    if(written == 0 && ferror(m_out)) {
-        Logger::Error("Error writing C file: {}", strerror(errno));
-        std::terminate();
+        stats_add(Counter::FramesOutput);
+        stats_add(Counter::BytesWritten, m_encodedBuffer.size());
+    } else {
+        submit_frame(m_currentFrame->data);
     }
 
     m_frameIndex++;
@@ -150,32 +363,309 @@ void COutput::run() {
     // For now just crash in this case.
     assert(!m_lastFrame);
 
-    m_lastFrame = m_currentFrame;
-    m_currentFrame = nullptr;
+    m_lastFrame = std::move(m_currentFrame);
 
     // We are done with the frame data
     lock.unlock();
     m_frameCondition.notify_all();
 }
 
-void COutput::finish() {
-    assert(m_out);
+void COutput::set_worker_count(int count) {
+    assert(!m_frameIndex && m_workers.empty());
+    if(count < 2) {
+        return;
+    }
+
+    for(int i = 0; i < count; i++) {
+        m_workers.emplace_back(&COutput::encode_worker, this);
+    }
+
+    m_writerThread = std::thread(&COutput::write_worker, this);
+}
+
+void COutput::submit_frame(const uint8_t* pixels) {
+    EncodeJob job;
+    job.index = m_frameIndex;
+    job.pixels = std::make_shared<std::vector<uint8_t>>(pixels, pixels + m_width * m_height);
+
+    // Delta frames need the previous frame to be packed as well
+    if(m_deltaEncoding) {
+        auto& previousPixels = m_lastSubmittedPixels[delta_reference(m_frameIndex)];
+        if(!is_keyframe(m_frameIndex)) {
+            job.previousPixels = std::move(previousPixels);
+        }
+        previousPixels = job.pixels;
+    }
+
+    std::unique_lock lock{m_jobLock};
+    // Don't let the encoders get too far ahead of the writer
+    m_jobCondition.wait(lock, [this]{
+        return m_jobsSubmitted - m_jobsWritten < (int)m_workers.size() * ENCODE_JOBS_PER_WORKER;
+    });
+
+    m_jobs.push_back(std::move(job));
+    m_jobsSubmitted++;
+
+    lock.unlock();
+    m_jobCondition.notify_all();
+}
+
+void COutput::encode_worker() {
+    trace_set_thread_name("encoder");
+
+    size_t bufferSize = ((m_width + 7) / 8) * m_height;
+    std::vector<uint8_t> packed(bufferSize);
+    std::vector<uint8_t> previousPacked(bufferSize);
+    std::vector<uint8_t> deltaBuffer;
+
+    while(true) {
+        std::unique_lock lock{m_jobLock};
+        m_jobCondition.wait(lock, [this]{ return m_stopWorkers || !m_jobs.empty(); });
+        if(m_jobs.empty()) {
+            return;
+        }
+
+        EncodeJob job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        lock.unlock();
+
+        StageTimer convertTimer{Stage::Convert};
+        unsigned size = pack_frame(job.pixels->data(), job.index, packed.data());
+        if(job.previousPixels) {
+            pack_frame(job.previousPixels->data(), job.index - (m_interlaced ? 2 : 1), previousPacked.data());
+        } else {
+            std::fill(previousPacked.begin(), previousPacked.end(), 0);
+        }
+
+        EncodedFrame frame;
+        encode_packed(packed.data(), previousPacked.data(), size, frame.data, deltaBuffer);
+
+        if(m_storage == FrameStorage::Array) {
+            CWriter::format_u8_array(frame.text, fmt::format("frame{}", job.index),
+                                     frame.data.data(), frame.data.size());
+        }
+        convertTimer.stop();
+
+        lock.lock();
+        m_encodedFrames.emplace(job.index, std::move(frame));
+        lock.unlock();
+        m_jobCondition.notify_all();
+    }
+}
+
+void COutput::write_worker() {
+    trace_set_thread_name("writer");
+
+    int index = 0;
+    while(true) {
+        std::unique_lock lock{m_jobLock};
+        m_jobCondition.wait(lock, [&]{
+            return m_encodedFrames.contains(index) || (m_stopWorkers && index == m_jobsSubmitted);
+        });
+
+        auto it = m_encodedFrames.find(index);
+        if(it == m_encodedFrames.end()) {
+            return;
+        }
+
+        EncodedFrame frame = std::move(it->second);
+        m_encodedFrames.erase(it);
+        lock.unlock();
+
+        StageTimer writeTimer{Stage::Write};
+        write_frame(index, frame.data.data(), frame.data.size(), &frame.text);
+        writeTimer.stop();
+
+        stats_add(Counter::FramesOutput);
+        stats_add(Counter::BytesWritten, frame.data.size());
+
+        lock.lock();
+        m_jobsWritten++;
+        lock.unlock();
+        m_jobCondition.notify_all();
+
+        index++;
+    }
+}
+
+void COutput::stop_workers() {
+    if(m_workers.empty()) {
+        return;
+    }
+
+    std::unique_lock lock{m_jobLock};
+    m_stopWorkers = true;
+    lock.unlock();
+    m_jobCondition.notify_all();
+
+    for(auto& worker : m_workers) {
+        worker.join();
+    }
+    m_workers.clear();
+
+    m_writerThread.join();
+}
+
+std::vector<uint16_t> COutput::frame_durations() const {
+    // Durations are in milliseconds to keep the table small,
+    // they are taken from the rounded timestamps so the error doesn't add up
+    long start = m_frameTimestamps.front();
+
+    std::vector<uint16_t> durations;
+    for(size_t i = 0; i < m_frameTimestamps.size(); i++) {
+        long duration;
+        if(i + 1 < m_frameTimestamps.size()) {
+            duration = (m_frameTimestamps[i + 1] - start + 500) / 1000
+                - (m_frameTimestamps[i] - start + 500) / 1000;
+        } else {
+            // Show the last frame for the average interval
+            duration = (m_frameInterval + 500) / 1000;
+        }
+
+        durations.push_back(std::clamp(duration, 0L, 0xffffL));
+    }
+
+    return durations;
+}
+
+void COutput::write_frame_durations() {
+    std::vector<std::string> durations;
+    for(uint16_t duration : frame_durations()) {
+        durations.push_back(fmt::format("{}", duration));
+    }
+
+    m_writer.write_array("uint16_t", "frame_durations", durations);
+}
+
+void COutput::write_object() {
+    // Laid out to match the declarations in c_frame_decoder.c
+    // for an LLP64 target, so long is 32-bit
+    m_object.align(8);
+    m_object.define_symbol("frames");
+    for(uint32_t offset : m_frameOffsets) {
+        m_object.write_pointer(offset);
+    }
+
+    int32_t frameCount = m_frameIndex;
+    m_object.define_symbol("frame_count");
+    m_object.write(&frameCount, sizeof(frameCount));
+
+    int32_t frameInterval = m_frameInterval;
+    m_object.define_symbol("frame_interval");
+    m_object.write(&frameInterval, sizeof(frameInterval));
+
+    if(!m_constantRate) {
+        std::vector<uint16_t> durations = frame_durations();
+        m_object.define_symbol("frame_durations");
+        m_object.write(durations.data(), durations.size() * sizeof(uint16_t));
+    }
+
+    m_object.finish();
+}
 
-    std::vector<std::string> frameNames;
-    for(int i = 0; i < m_frameIndex; i++) {
-        frameNames.push_back(fmt::format("frame{}", i));
+CWriter& COutput::frame_writer(int) {
+    return m_writer;
+}
+
+void COutput::measure_frame_rate() {
+    // Assume 24fps if there is nothing to go off
+    m_frameInterval = 1000000 / 24;
+    m_constantRate = true;
+    if(m_frameTimestamps.size() > 1) {
+        long first = m_frameTimestamps.front();
+        long last = m_frameTimestamps.back();
+        m_frameInterval = (last - first) / (long)(m_frameTimestamps.size() - 1);
+
+        // Timestamps get rounded so allow a little leeway
+        for(size_t i = 1; i < m_frameTimestamps.size(); i++) {
+            long delta = m_frameTimestamps[i] - m_frameTimestamps[i - 1];
+            if(std::abs(delta - m_frameInterval) > FRAME_INTERVAL_TOLERANCE) {
+                m_constantRate = false;
+                break;
+            }
+        }
     }
+}
 
-    std::string text =
-        fmt::format("#define FRAME_COUNT ({})\n#define FRAME_WIDTH ({})\n\
-        #define FRAME_HEIGHT ({})\n#define FRAME_INTERVAL ({})\n",
-            m_frameIndex, m_width, m_height, 1000000 / 24);
+std::vector<std::pair<std::string, std::string>> COutput::decoder_defines() const {
+    std::vector<std::pair<std::string, std::string>> defines = {
+        {"FRAME_WIDTH", std::to_string(m_width)},
+        {"FRAME_HEIGHT", std::to_string(m_height)},
+    };
+
+    if(!m_constantRate) {
+        defines.emplace_back("USE_FRAME_DURATIONS", "");
+    }
 
     if(m_interlaced) {
-        text += "#define USE_INTERLACING\n";
+        defines.emplace_back("USE_INTERLACING", "");
+    }
+
+    if(m_deltaEncoding) {
+        defines.emplace_back("USE_DELTA_FRAMES", "");
+    }
+
+    if(m_compression == FrameCompression::RLE) {
+        defines.emplace_back("USE_RLE_FRAMES", "");
+    } else if(m_compression == FrameCompression::LZ) {
+        defines.emplace_back("USE_LZ_FRAMES", "");
+    }
+
+    return defines;
+}
+
+void COutput::finish() {
+    assert(m_out || m_storage == FrameStorage::Object);
+
+    // Wait for every frame to be written out
+    stop_workers();
+
+    if(m_storage == FrameStorage::Incbin || m_storage == FrameStorage::Embed) {
+        // Make sure all the frame data is on disk before the compiler sees it
+        if(fclose(m_blob)) {
+            Logger::Error("Error writing '{}': {}", m_blobPath, strerror(errno));
+            std::terminate();
+        }
+        m_blob = nullptr;
+
+        write_blob_include();
+    }
+
+    Logger::Debug("{} frames, {} unique", m_frameIndex, m_uniqueFrames.size());
+
+    measure_frame_rate();
+
+    if(m_storage == FrameStorage::Object) {
+        write_object();
+        return;
+    }
+
+    m_writer.print("#define FRAME_COUNT ({})\n#define FRAME_INTERVAL ({})\n",
+            m_frameIndex, m_frameInterval);
+
+    for(const auto& [name, value] : decoder_defines()) {
+        if(value.empty()) {
+            m_writer.print("#define {}\n", name);
+        } else {
+            m_writer.print("#define {} ({})\n", name, value);
+        }
+    }
+
+    if(m_separateDecoder) {
+        m_writer.write("const int frame_count = FRAME_COUNT;\n");
+        m_writer.write("const long frame_interval = FRAME_INTERVAL;\n");
+    }
+
+    if(!m_constantRate) {
+        write_frame_durations();
+    }
+
+    // Frames in other translation units have to be declared before the table
+    for(const auto& name : m_externFrames) {
+        m_writer.print("extern uint8_t {}[];\n", name);
     }
 
-    text += generate_c_array("uint8_t*", "frames", frameNames);
-    fwrite(text.c_str(), 1, text.length(), m_out);
+    m_writer.write_array("uint8_t*", "frames", m_frameNames);
+    m_writer.flush();
     fflush(m_out);
 }
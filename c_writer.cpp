@@ -0,0 +1,163 @@
+#include "c_writer.h"
+
+#include "logger.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include <array>
+
+// Max characters per line
+#define GEN_C_LINE_MAX 80
+
+// Values per line in 8-bit arrays
+#define GEN_C_U8_PER_LINE 16
+
+namespace {
+
+struct U8Text {
+    // Always 4 bytes so it can be copied in one go,
+    // only the first length bytes are used
+    char text[4];
+    uint8_t length;
+};
+
+// "n," for every 8-bit value.
+// Since we are dealing with 8-bit ints,
+// it will save a little more room to use decimal instead of hex
+constexpr std::array<U8Text, 256> make_u8_table() {
+    std::array<U8Text, 256> table{};
+    for(int i = 0; i < 256; i++) {
+        U8Text& t = table[i];
+        int len = 0;
+        if(i >= 100) {
+            t.text[len++] = '0' + i / 100;
+        }
+        if(i >= 10) {
+            t.text[len++] = '0' + (i / 10) % 10;
+        }
+        t.text[len++] = '0' + i % 10;
+        t.text[len++] = ',';
+
+        t.length = len;
+    }
+
+    return table;
+}
+
+constexpr std::array<U8Text, 256> u8Table = make_u8_table();
+
+}
+
+CWriter::CWriter() {}
+
+void CWriter::set_file(FILE* file) {
+    m_file = file;
+}
+
+void CWriter::write(std::string_view text) {
+    if(text.length() > C_WRITER_BUFFER_SIZE) {
+        flush();
+
+        if(fwrite(text.data(), 1, text.length(), m_file) != text.length()) {
+            Logger::Error("Error writing C file: {}", strerror(errno));
+            std::terminate();
+        }
+        return;
+    }
+
+    reserve(text.length());
+    memcpy(m_buffer + m_used, text.data(), text.length());
+    m_used += text.length();
+}
+
+void CWriter::write_array(std::string_view type, std::string_view name,
+                          const std::vector<std::string>& values) {
+    print("{} {}[{}] = {{\n    ", type, name, values.size());
+
+    int length = 4;
+    for(const auto& v : values) {
+        // Wrap to the next line if necessary
+        // add 1 to the length to account for the comma
+        length += v.length() + 1;
+        if(length > GEN_C_LINE_MAX) {
+            length = 4 + v.length() + 1;
+            write("\n    ");
+        }
+
+        write(v);
+        write(",");
+    }
+
+    write("};\n");
+}
+
+// Longest possible line of an 8-bit array is the indent,
+// 4 characters per value and a newline
+#define GEN_C_U8_LINE_MAX (4 + 4 * GEN_C_U8_PER_LINE + 1)
+
+// Writes a line of up to GEN_C_U8_PER_LINE values to p,
+// returns the end of the line
+static inline char* format_u8_line(char* p, const uint8_t* values, unsigned count) {
+    memcpy(p, "    ", 4);
+    p += 4;
+
+    for(unsigned i = 0; i < count; i++) {
+        const U8Text& t = u8Table[values[i]];
+        memcpy(p, t.text, 4);
+        p += t.length;
+    }
+    *(p++) = '\n';
+
+    return p;
+}
+
+void CWriter::write_u8_array(std::string_view name, const uint8_t* values, unsigned count) {
+    print("uint8_t {}[{}] = {{\n", name, count);
+
+    while(count) {
+        unsigned n = count < GEN_C_U8_PER_LINE ? count : GEN_C_U8_PER_LINE;
+        reserve(GEN_C_U8_LINE_MAX);
+
+        m_used = format_u8_line(m_buffer + m_used, values, n) - m_buffer;
+        values += n;
+        count -= n;
+    }
+
+    write("};\n");
+}
+
+void CWriter::format_u8_array(std::string& out, std::string_view name, const uint8_t* values, unsigned count) {
+    out = fmt::format("uint8_t {}[{}] = {{\n", name, count);
+
+    size_t used = out.length();
+    out.resize(used + (count + GEN_C_U8_PER_LINE - 1) / GEN_C_U8_PER_LINE * GEN_C_U8_LINE_MAX + 3);
+
+    char* start = out.data();
+    char* p = start + used;
+    while(count) {
+        unsigned n = count < GEN_C_U8_PER_LINE ? count : GEN_C_U8_PER_LINE;
+
+        p = format_u8_line(p, values, n);
+        values += n;
+        count -= n;
+    }
+
+    memcpy(p, "};\n", 3);
+    out.resize(p + 3 - start);
+}
+
+void CWriter::flush() {
+    if(!m_used) {
+        return;
+    }
+
+    assert(m_file);
+    if(fwrite(m_buffer, 1, m_used, m_file) != m_used) {
+        Logger::Error("Error writing C file: {}", strerror(errno));
+        std::terminate();
+    }
+
+    m_used = 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <fmt/format.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Size of the buffer the generated source is kept in before
+// being written to the file
+#define C_WRITER_BUFFER_SIZE 0x10000
+
+// Streams generated C source to a file,
+// buffering it so that it is written in large chunks
+class CWriter {
+public:
+    CWriter();
+
+    void set_file(FILE* file);
+
+    void write(std::string_view text);
+
+    template <typename... Args> inline void print(fmt::format_string<Args...> f, Args&&... args) {
+        fmt::memory_buffer text;
+        fmt::vformat_to(std::back_inserter(text), f, fmt::make_format_args(args...));
+        write({text.data(), text.size()});
+    }
+
+    // Writes an array of the given type where each value is a string
+    void write_array(std::string_view type, std::string_view name,
+                     const std::vector<std::string>& values);
+    // Writes an array of 8-bit integers in decimal
+    void write_u8_array(std::string_view name, const uint8_t* values, unsigned count);
+    // Same as write_u8_array but into a string,
+    // so arrays can be generated on other threads
+    static void format_u8_array(std::string& out, std::string_view name,
+                                const uint8_t* values, unsigned count);
+
+    // Writes out anything left in the buffer
+    void flush();
+
+private:
+    // Makes sure there is room for size bytes in the buffer
+    inline void reserve(size_t size) {
+        if(m_used + size > C_WRITER_BUFFER_SIZE) {
+            flush();
+        }
+    }
+
+    FILE* m_file = nullptr;
+
+    char m_buffer[C_WRITER_BUFFER_SIZE];
+    size_t m_used = 0;
+};
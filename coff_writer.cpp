@@ -0,0 +1,210 @@
+#include "coff_writer.h"
+
+#include "logger.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#define COFF_MACHINE_AMD64 0x8664
+
+#define COFF_FILE_HEADER_SIZE 20
+#define COFF_SECTION_HEADER_SIZE 40
+#define COFF_RELOCATION_SIZE 10
+#define COFF_SYMBOL_SIZE 18
+
+// Section contents start straight after the headers
+#define COFF_SECTION_DATA_OFFSET (COFF_FILE_HEADER_SIZE + COFF_SECTION_HEADER_SIZE)
+
+#define COFF_SCN_CNT_INITIALIZED_DATA 0x00000040
+#define COFF_SCN_ALIGN_16BYTES 0x00500000
+#define COFF_SCN_LNK_NRELOC_OVFL 0x01000000
+#define COFF_SCN_MEM_READ 0x40000000
+
+#define COFF_REL_AMD64_ADDR64 0x0001
+
+#define COFF_SYM_CLASS_EXTERNAL 2
+#define COFF_SYM_CLASS_STATIC 3
+
+// Everything in COFF is little endian
+static void put16(std::vector<uint8_t>& out, uint16_t value) {
+    out.push_back(value & 0xff);
+    out.push_back(value >> 8);
+}
+
+static void put32(std::vector<uint8_t>& out, uint32_t value) {
+    put16(out, value & 0xffff);
+    put16(out, value >> 16);
+}
+
+// Symbol names longer than 8 characters go in the string table
+static void put_symbol_name(std::vector<uint8_t>& out, std::string& strings, const std::string& name) {
+    if(name.length() <= 8) {
+        char shortName[8] = {};
+        memcpy(shortName, name.data(), name.length());
+        out.insert(out.end(), shortName, shortName + 8);
+        return;
+    }
+
+    put32(out, 0);
+    // Offsets include the size field at the start of the table
+    put32(out, strings.length() + 4);
+    strings.append(name.c_str(), name.length() + 1);
+}
+
+CoffWriter::~CoffWriter() {
+    if(m_file) {
+        fclose(m_file);
+    }
+}
+
+int CoffWriter::open(const char* path) {
+    assert(!m_file);
+
+    m_path = path;
+    m_file = fopen(path, "wb");
+    if(!m_file) {
+        Logger::Error("Failed to open '{}' for writing!", path);
+        return 1;
+    }
+
+    // Leave room for the headers, they are written once the sizes are known
+    if(fseek(m_file, COFF_SECTION_DATA_OFFSET, SEEK_SET)) {
+        Logger::Error("Error writing '{}': {}", m_path, strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
+
+uint32_t CoffWriter::write(const void* data, size_t size) {
+    assert(m_file);
+
+    if(size > UINT32_MAX - m_size) {
+        Logger::Error("'{}' is too large for a COFF section!", m_path);
+        std::terminate();
+    }
+
+    if(fwrite(data, 1, size, m_file) != size) {
+        Logger::Error("Error writing '{}': {}", m_path, strerror(errno));
+        std::terminate();
+    }
+
+    uint32_t offset = m_size;
+    m_size += size;
+    return offset;
+}
+
+void CoffWriter::align(unsigned alignment) {
+    static const uint8_t padding[16] = {};
+    assert(alignment <= sizeof(padding));
+
+    write(padding, (alignment - m_size % alignment) % alignment);
+}
+
+void CoffWriter::write_pointer(uint32_t offset) {
+    // The linker adds the address of the section to the value in place
+    uint8_t address[8] = {};
+    for(int i = 0; i < 4; i++) {
+        address[i] = offset >> (i * 8);
+    }
+
+    m_relocations.push_back(write(address, sizeof(address)));
+}
+
+void CoffWriter::define_symbol(std::string name) {
+    m_symbols.emplace_back(std::move(name), m_size);
+}
+
+void CoffWriter::finish() {
+    assert(m_file);
+
+    std::vector<uint8_t> out;
+    std::string strings;
+
+    // Sections can only count 0xffff relocations,
+    // past that the real count goes in an extra first relocation
+    bool relocationOverflow = m_relocations.size() >= 0xffff;
+    uint32_t relocationCount = m_relocations.size() + relocationOverflow;
+
+    if(relocationOverflow) {
+        put32(out, relocationCount);
+        put32(out, 0);
+        put16(out, 0);
+    }
+
+    // Relocations are all against the section symbol, which is symbol 0
+    for(uint32_t offset : m_relocations) {
+        put32(out, offset);
+        put32(out, 0);
+        put16(out, COFF_REL_AMD64_ADDR64);
+    }
+
+    uint32_t symbolTableOffset = COFF_SECTION_DATA_OFFSET + m_size + out.size();
+
+    // Section symbol followed by its definition
+    put_symbol_name(out, strings, ".rdata");
+    put32(out, 0);
+    put16(out, 1);
+    put16(out, 0);
+    out.push_back(COFF_SYM_CLASS_STATIC);
+    out.push_back(1);
+
+    put32(out, m_size);
+    put16(out, relocationOverflow ? 0xffff : relocationCount);
+    put16(out, 0);
+    put32(out, 0);
+    put16(out, 0);
+    out.resize(out.size() + 4);
+
+    for(const auto& [name, offset] : m_symbols) {
+        put_symbol_name(out, strings, name);
+        put32(out, offset);
+        put16(out, 1);
+        put16(out, 0);
+        out.push_back(COFF_SYM_CLASS_EXTERNAL);
+        out.push_back(0);
+    }
+
+    put32(out, strings.length() + 4);
+    out.insert(out.end(), strings.begin(), strings.end());
+
+    std::vector<uint8_t> header;
+    put16(header, COFF_MACHINE_AMD64);
+    // Number of sections
+    put16(header, 1);
+    // Timestamp, left out so the output is reproducible
+    put32(header, 0);
+    put32(header, symbolTableOffset);
+    put32(header, 2 + m_symbols.size());
+    // No optional header or flags
+    put16(header, 0);
+    put16(header, 0);
+
+    char sectionName[8] = ".rdata";
+    header.insert(header.end(), sectionName, sectionName + 8);
+    // Virtual size and address are unused in objects
+    put32(header, 0);
+    put32(header, 0);
+    put32(header, m_size);
+    put32(header, COFF_SECTION_DATA_OFFSET);
+    put32(header, m_relocations.empty() ? 0 : COFF_SECTION_DATA_OFFSET + m_size);
+    // No line numbers
+    put32(header, 0);
+    put16(header, relocationOverflow ? 0xffff : relocationCount);
+    put16(header, 0);
+    put32(header, COFF_SCN_CNT_INITIALIZED_DATA | COFF_SCN_ALIGN_16BYTES | COFF_SCN_MEM_READ
+            | (relocationOverflow ? COFF_SCN_LNK_NRELOC_OVFL : 0));
+
+    assert(header.size() == COFF_SECTION_DATA_OFFSET);
+
+    if(fwrite(out.data(), 1, out.size(), m_file) != out.size()
+            || fseek(m_file, 0, SEEK_SET)
+            || fwrite(header.data(), 1, header.size(), m_file) != header.size()
+            || fclose(m_file)) {
+        Logger::Error("Error writing '{}': {}", m_path, strerror(errno));
+        std::terminate();
+    }
+
+    m_file = nullptr;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Writes an AMD64 COFF object with a single read only data section,
+// so data can be linked into a PE image without going through a compiler.
+// The section contents are streamed straight to the file
+class CoffWriter {
+public:
+    ~CoffWriter();
+
+    int open(const char* path);
+
+    // Appends size bytes to the section, returns the offset they start at
+    uint32_t write(const void* data, size_t size);
+    // Pads the section to a multiple of alignment
+    void align(unsigned alignment);
+    // Appends the address of offset in the section
+    void write_pointer(uint32_t offset);
+
+    // Exports name as the current end of the section
+    void define_symbol(std::string name);
+
+    // Writes out the relocations, symbols and headers then closes the file
+    void finish();
+
+private:
+    FILE* m_file = nullptr;
+    std::string m_path;
+
+    uint32_t m_size = 0;
+    // Offsets of 64-bit addresses which need relocating
+    std::vector<uint32_t> m_relocations;
+    // Name and offset of each exported symbol
+    std::vector<std::pair<std::string, uint32_t>> m_symbols;
+};
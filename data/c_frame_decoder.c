@@ -1,5 +1,22 @@
 #include <stdint.h>
 
+#ifdef SEPARATE_FRAME_DATA
+
+// The frame data is in another object so the decoder can be built once
+// for every video with the same dimensions and encoding
+extern uint8_t* frames[];
+extern const int frame_count;
+extern const long frame_interval;
+
+#ifdef USE_FRAME_DURATIONS
+extern uint16_t frame_durations[];
+#endif
+
+#define FRAME_COUNT frame_count
+#define FRAME_INTERVAL frame_interval
+
+#endif
+
 #if defined(WIN32)
 
 #define ENCODING_CP437
@@ -16,6 +33,124 @@
     #error "FRAME_HEIGHT must be divisible by 2!"
 #endif
 
+#ifdef USE_INTERLACING
+    #if (FRAME_HEIGHT % 4)
+        #error "FRAME_HEIGHT must be divisible by 4 when interlacing!"
+    #endif
+
+// Each frame only has every other line of text,
+// even frames have the even lines and odd frames the odd lines
+#define FRAME_DATA_SIZE (FRAME_STRIDE * FRAME_HEIGHT / 2)
+#else
+#define FRAME_DATA_SIZE (FRAME_STRIDE * FRAME_HEIGHT)
+#endif
+
+#if defined(USE_RLE_FRAMES) || defined(USE_LZ_FRAMES)
+
+#define USE_COMPRESSED_FRAMES
+
+// Frames are decompressed into here
+uint8_t decompress_buffer[FRAME_DATA_SIZE];
+
+#endif
+
+#if defined(USE_RLE_FRAMES)
+
+// PackBits style run-length encoding,
+// a header byte n below 128 is followed by n + 1 literal bytes
+// and above 128 repeats the next byte 257 - n times
+void decompress_frame(uint8_t* out, uint8_t* in) {
+    uint8_t* end = out + FRAME_DATA_SIZE;
+    while(out < end) {
+        int n = *(in++);
+        if(n < 128) {
+            n++;
+            while(n--) {
+                *(out++) = *(in++);
+            }
+        } else if(n > 128) {
+            uint8_t value = *(in++);
+
+            n = 257 - n;
+            while(n--) {
+                *(out++) = value;
+            }
+        }
+    }
+}
+
+#elif defined(USE_LZ_FRAMES)
+
+// A token t below 128 is followed by t + 1 literal bytes,
+// otherwise copy (t & 127) + 3 bytes from a 16-bit offset back in the output
+void decompress_frame(uint8_t* out, uint8_t* in) {
+    uint8_t* end = out + FRAME_DATA_SIZE;
+    while(out < end) {
+        int t = *(in++);
+        if(t < 128) {
+            t++;
+            while(t--) {
+                *(out++) = *(in++);
+            }
+        } else {
+            int length = (t & 127) + 3;
+            int offset = in[0] | (in[1] << 8);
+            in += 2;
+
+            uint8_t* match = out - offset;
+            while(length--) {
+                *(out++) = *(match++);
+            }
+        }
+    }
+}
+
+#endif
+
+#ifdef USE_DELTA_FRAMES
+
+// Each frame is stored as spans of bytes to XOR into the previous frame,
+// a span is the number of unchanged bytes to skip, the number of bytes
+// that changed and then the changed bytes.
+#ifdef USE_INTERLACING
+// Interlaced frames are XORed into the last frame with the same field
+uint8_t frame_buffers[2][FRAME_DATA_SIZE];
+#define frame_buffer(index) frame_buffers[(index) & 1]
+#else
+uint8_t frame_buffers[1][FRAME_DATA_SIZE];
+#define frame_buffer(index) frame_buffers[0]
+#endif
+
+#ifdef USE_COMPRESSED_FRAMES
+
+// Compressed delta frames are the previous frame XORed with the current one
+void apply_delta(uint8_t* frame, uint8_t* delta) {
+    uint8_t* end = frame + FRAME_DATA_SIZE;
+    while(frame < end) {
+        *(frame++) ^= *(delta++);
+    }
+}
+
+#else
+
+void apply_delta(uint8_t* frame, uint8_t* delta) {
+    uint8_t* end = frame + FRAME_DATA_SIZE;
+    while(frame < end) {
+        frame += *(delta++);
+
+        int count = *(delta++);
+        while(count--) {
+            *(frame++) ^= *(delta++);
+        }
+    }
+}
+
+#endif
+
+#endif
+
+#ifndef USE_FRAMEBUFFER
+
 #if defined(ENCODING_CP437)
 
 typedef char tty_char_t;
@@ -28,7 +163,6 @@ typedef char tty_char_t;
 #define put_block_top_character(text, i) text[i++] = CP437_HALFBLOCK_TOP;
 #define put_block_bottom_character(text, i) text[i++] = CP437_HALFBLOCK_BOTTOM;
 #define put_blank_character(text, i) text[i++] = ' ';
-#define put_line_ending(text, i) text[i++] = '\r'; text[i++] = '\n';
 
 #define LINE_WIDTH_MULTIPLIER 1
 
@@ -44,7 +178,6 @@ typedef uint16_t tty_char_t;
 #define put_block_top_character(text, i) text[i++] = UTF16_HALFBLOCK_TOP;
 #define put_block_bottom_character(text, i) text[i++] = UTF16_HALFBLOCK_BOTTOM;
 #define put_blank_character(text, i) text[i++] = ' ';
-#define put_line_ending(text, i) text[i++] = '\r'; text[i++] = '\n';
 
 #define LINE_WIDTH_MULTIPLIER 1
 
@@ -66,83 +199,229 @@ typedef char tty_char_t;
 #define put_block_bottom_character(text, i) text[i++] = UTF8_BLOCK_0; \
     text[i++] = UTF8_BLOCK_1; text[i++] = UTF8_HALFBLOCK_BOTTOM_2;
 #define put_blank_character(text, i) text[i++] = ' ';
-#define put_line_ending(text, i) text[i++] = '\n';
 
 #define LINE_WIDTH_MULTIPLIER 3
 
 #endif
 
+#endif
+
 void us_sleep(long us);
-void reset_cursor();
+// Monotonic time in microseconds
+long long us_time();
+#ifdef USE_FRAMEBUFFER
+// Size of the screen in pixels and the value of a white pixel
+void get_screen_info(int* width, int* height, uint32_t* white);
+// Draws count copies of a row of width pixels from x, y downwards
+void put_scanline(int x, int y, int width, int count, uint32_t* pixels);
+#else
+void set_cursor(int column, int row);
 void print_text(tty_char_t* text);
+#endif
+
+#ifdef USE_INTERLACING
+// Lines of text in each frame
+#define FRAME_LINES (FRAME_HEIGHT / 4)
+// Line on the screen of the nth line in frame index
+#define screen_line(n, index) ((n) * 2 + ((index) & 1))
+#else
+#define FRAME_LINES (FRAME_HEIGHT / 2)
+#define screen_line(n, index) (n)
+#endif
+
+
+// Packed pixels of what is currently on the screen,
+// only lines which have changed get printed
+uint8_t screen_pixels[FRAME_STRIDE * FRAME_HEIGHT];
+uint8_t line_drawn[FRAME_HEIGHT / 2];
+
+// Returns 1 if the line has changed and copies it to the screen
+int update_line(int line, uint8_t* rows) {
+    uint8_t* current = screen_pixels + FRAME_STRIDE * 2 * line;
+
+    int changed = !line_drawn[line];
+    for(int b = 0; b < FRAME_STRIDE * 2; b++) {
+        if(current[b] != rows[b]) {
+            current[b] = rows[b];
+            changed = 1;
+        }
+    }
+
+    line_drawn[line] = 1;
+    return changed;
+}
+
+#ifdef USE_FRAMEBUFFER
+
+// Frames are scaled up by a whole number to fill as much of the screen as they can
+#define MAX_SCREEN_SCALE 16
+
+int screen_scale;
+// Top left of the frame on the screen
+int screen_x;
+int screen_y;
+uint32_t screen_white;
+
+// A row of pixels after scaling
+uint32_t scanline[FRAME_WIDTH * MAX_SCREEN_SCALE];
+
+void init_screen() {
+    int width, height;
+    get_screen_info(&width, &height, &screen_white);
+
+    screen_scale = width / FRAME_WIDTH;
+    if(screen_scale > height / FRAME_HEIGHT) {
+        screen_scale = height / FRAME_HEIGHT;
+    }
+
+    if(screen_scale < 1) {
+        screen_scale = 1;
+    } else if(screen_scale > MAX_SCREEN_SCALE) {
+        screen_scale = MAX_SCREEN_SCALE;
+    }
+
+    // Center the frame, anything that doesn't fit gets clipped
+    screen_x = (width - FRAME_WIDTH * screen_scale) / 2;
+    screen_y = (height - FRAME_HEIGHT * screen_scale) / 2;
+    if(screen_x < 0) {
+        screen_x = 0;
+    }
+
+    if(screen_y < 0) {
+        screen_y = 0;
+    }
+}
+
+// Unpacks a row of pixels and draws it scaled up
+void draw_row(int y, uint8_t* row) {
+    uint32_t* out = scanline;
+    for(int c = 0; c < FRAME_WIDTH; c += 8) {
+        uint8_t pixels = *(row++);
+
+        // Rows are padded to 8 pixels, the last byte only
+        // has the pixels that are left, in its low bits
+        int first = 7;
+        if(first > FRAME_WIDTH - c - 1) {
+            first = FRAME_WIDTH - c - 1;
+        }
+
+        for(int p = first; p >= 0; p--) {
+            // All ones when the pixel is set
+            uint32_t value = -(uint32_t)((pixels >> p) & 1) & screen_white;
+            for(int s = 0; s < screen_scale; s++) {
+                *(out++) = value;
+            }
+        }
+    }
+
+    put_scanline(screen_x, screen_y + y * screen_scale,
+        FRAME_WIDTH * screen_scale, screen_scale, scanline);
+}
+
+// Each line is two rows of pixels
+void draw_line(int line, uint8_t* top) {
+    draw_row(line * 2, top);
+    draw_row(line * 2 + 1, top + FRAME_STRIDE);
+}
+
+#else
 
 // Very lazy but let's just multiply the frame width by 3 to account
 // for the unicode characters.
-tty_char_t text[(FRAME_WIDTH * LINE_WIDTH_MULTIPLIER + 2) * (FRAME_HEIGHT / 2) + 1];
+tty_char_t text[FRAME_WIDTH * LINE_WIDTH_MULTIPLIER + 1];
+
+void draw_line(int line, uint8_t* top) {
+    uint8_t* bottom = top + FRAME_STRIDE;
+
+    int i = 0;
+    int c = 0;
+    while(c < FRAME_WIDTH) {
+        uint8_t p1 = *(top++);
+        uint8_t p2 = *(bottom++);
+
+        // Rows are padded to 8 pixels,
+        // the last byte only has the pixels that are left
+        int p = 7;
+        if(p > FRAME_WIDTH - c - 1) {
+            p = FRAME_WIDTH - c - 1;
+        }
+
+        c += (p + 1);
+
+        while(p >= 0) {
+            if(((p1 >> p) & 1)) {
+                if((p2 >> p) & 1) {
+                    put_block_character(text, i);
+                } else {
+                    put_block_top_character(text, i);
+                }
+            } else if((p2 >> p) & 1) {
+                put_block_bottom_character(text, i);
+            } else {
+                put_blank_character(text, i);
+            }
+
+            p--;
+        }
+    }
+
+    text[i++] = 0;
+
+    set_cursor(0, line);
+    print_text(text);
+}
+
+#endif
 
 void play_frames() {
     int frameIndex = 0;
 
+#ifdef USE_FRAMEBUFFER
+    init_screen();
+#endif
+
+    // Frames are scheduled from when playback started rather than when the
+    // last one was drawn, so the time spent drawing doesn't add up
+    long long start = us_time();
+    long long elapsed = 0;
+
     uint8_t** _frames = frames;
     while(frameIndex < FRAME_COUNT) {
         uint8_t* frame = *(_frames++);
-        
-        int i = 0;
-#ifdef USE_INTERLACING
-        if(frameIndex & 1) {
-            put_line_ending(text, i);
-        }
+#ifdef USE_COMPRESSED_FRAMES
+        decompress_frame(decompress_buffer, frame);
+        frame = decompress_buffer;
+#endif
+#ifdef USE_DELTA_FRAMES
+        apply_delta(frame_buffer(frameIndex), frame);
+        frame = frame_buffer(frameIndex);
+#endif
 
-        for(int row = 0; row < FRAME_HEIGHT / 2; row += 2) {
+#ifdef USE_FRAME_DURATIONS
+        // Variable frame rate, durations are in milliseconds
+        elapsed += frame_durations[frameIndex] * 1000LL;
 #else
-        for(int row = 0; row < FRAME_HEIGHT; row += 2) {
+        elapsed += FRAME_INTERVAL;
 #endif
-            uint8_t* top = frame + FRAME_STRIDE * row;
-            uint8_t* bottom = frame + FRAME_STRIDE * (row + 1);
-
-            int c = 0;
-            while(c < FRAME_WIDTH) {
-                uint8_t p1 = *(top++);
-                uint8_t p2 = *(bottom++);
-
-                int p = 7;
-                if(p > FRAME_WIDTH - c - 1) {
-                    p = 7 - (FRAME_WIDTH - c - 1);
-                }
-
-                c += (p + 1);
-
-                while(p >= 0) {
-                    if(((p1 >> p) & 1)) {
-                        if((p2 >> p) & 1) {
-                            put_block_character(text, i);
-                        } else {
-                            put_block_top_character(text, i);
-                        }
-                    } else if((p2 >> p) & 1) {
-                        put_block_bottom_character(text, i);
-                    } else {
-                        put_blank_character(text, i);
-                    }
-
-                    p--;
+        long long next = start + elapsed;
+
+        // If the next frame is already due we are behind,
+        // so drop this one to catch up. The frame still has to be decoded
+        // as delta frames depend on it.
+        if(us_time() < next || frameIndex == FRAME_COUNT - 1) {
+            for(int n = 0; n < FRAME_LINES; n++) {
+                uint8_t* rows = frame + FRAME_STRIDE * 2 * n;
+                int line = screen_line(n, frameIndex);
+
+                if(update_line(line, rows)) {
+                    draw_line(line, rows);
                 }
             }
-
-            // End the line
-            put_line_ending(text, i);
-#ifdef USE_INTERLACING
-            // Put an extra line ending if interlacing is enabled
-            put_line_ending(text, i);
-#endif
         }
 
-        text[i++] = 0;
-
-        reset_cursor();
-        print_text(text);
-
-        us_sleep(FRAME_INTERVAL);
+        // Wait for whatever is left of the frame interval
+        long long remaining = next - us_time();
+        us_sleep(remaining > 0 ? remaining : 0);
 
         frameIndex++;
     }
@@ -2,13 +2,23 @@
 
 #if defined(__unix)
 
+#include <time.h>
 #include <unistd.h>
 void us_sleep(long us) {
+    // Make sure the frame is on screen before waiting
+    fflush(stdout);
     usleep(us);
 }
 
-void reset_cursor() {
-    puts("\033[1;1H");
+long long us_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void set_cursor(int column, int row) {
+    printf("\033[%d;%dH", row + 1, column + 1);
 }
 
 #elif defined(WIN32)
@@ -17,28 +27,47 @@ void reset_cursor() {
 
 #include <windows.h>
 void us_sleep(long us) {
-    sleep(x / 1000)
+    fflush(stdout);
+    Sleep(us / 1000);
+}
+
+long long us_time() {
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+
+    return counter.QuadPart / frequency.QuadPart * 1000000LL
+        + counter.QuadPart % frequency.QuadPart * 1000000LL / frequency.QuadPart;
 }
 
-HANDLE stdoutHandle;
-COORD cursorTopLeft = {0, 0};
+void set_cursor(int column, int row) {
+    // Anything buffered has to be written before the cursor moves
+    fflush(stdout);
 
-void reset_cursor() {
-    SetConsoleCursorPosition(GetStdHandle(STD_OUTPUT_HANDLE), cursorTopLeft);
+    COORD position = {column, row};
+    SetConsoleCursorPosition(GetStdHandle(STD_OUTPUT_HANDLE), position);
 }
 
 #else
 
-void us_sleep(long us) {}
+void us_sleep(long us) {
+    fflush(stdout);
+}
+
+// No clock so never drop any frames
+long long us_time() {
+    return 0;
+}
 
-void reset_cursor() {
-    puts("\033[1;1H");
+void set_cursor(int column, int row) {
+    printf("\033[%d;%dH", row + 1, column + 1);
 }
 
 #endif
 
 void print_text(char* text) {
-    puts(text);
+    fputs(text, stdout);
 }
 
 void play_frames();
@@ -63,4 +63,9 @@ typedef uintptr_t UINTN;
 ///
 typedef intptr_t INTN;
 
+///
+/// A value of native width with the highest bit set, used to encode error codes
+///
+#define MAX_BIT  ((UINTN)1 << (sizeof (UINTN) * 8 - 1))
+
 #endif // PROCESSOR_BIND_H
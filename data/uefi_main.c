@@ -1,6 +1,10 @@
 #include <UefiBaseType.h>
 #include <UefiSpec.h>
 
+#ifdef USE_FRAMEBUFFER
+#include <GraphicsOutput.h>
+#endif
+
 void play_frames();
 
 EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL* console;
@@ -9,20 +13,120 @@ EFI_TEXT_SET_CURSOR_POSITION set_cursor_position;
 
 EFI_STALL stall;
 
+// Calibrated against Stall at startup
+UINT64 tsc_per_us;
+
 void __chkstk() {}
 
 void us_sleep(long us) {
     stall(us);
 }
 
-void reset_cursor() {
-    set_cursor_position(console, 0, 0);
+UINT64 read_tsc() {
+    UINT32 low, high;
+    __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+
+    return ((UINT64)high << 32) | low;
+}
+
+// GetTime usually only has a resolution of a second,
+// so use the TSC instead
+long long us_time() {
+    return read_tsc() / tsc_per_us;
+}
+
+void calibrate_tsc() {
+    UINT64 start = read_tsc();
+    stall(10000);
+
+    tsc_per_us = (read_tsc() - start) / 10000;
+    if(!tsc_per_us) {
+        tsc_per_us = 1;
+    }
+}
+
+void set_cursor(int column, int row) {
+    set_cursor_position(console, column, row);
 }
 
 void print_text(CHAR16* text) {
     output_string(console, text);
 }
 
+#ifdef USE_FRAMEBUFFER
+
+EFI_GRAPHICS_OUTPUT_PROTOCOL* graphics;
+EFI_GRAPHICS_OUTPUT_MODE_INFORMATION* graphics_mode;
+
+// Written to directly when there is a linear framebuffer,
+// otherwise everything goes through Blt
+UINT32* framebuffer;
+
+void get_screen_info(int* width, int* height, UINT32* white) {
+    *width = graphics_mode->HorizontalResolution;
+    *height = graphics_mode->VerticalResolution;
+
+    if(graphics_mode->PixelFormat == PixelBitMask) {
+        EFI_PIXEL_BITMASK* masks = &graphics_mode->PixelInformation;
+        *white = masks->RedMask | masks->GreenMask | masks->BlueMask;
+    } else {
+        // Same for RGB, BGR and Blt pixels
+        *white = 0xffffff;
+    }
+}
+
+void put_scanline(int x, int y, int width, int count, UINT32* pixels) {
+    if(x + width > (int)graphics_mode->HorizontalResolution) {
+        width = graphics_mode->HorizontalResolution - x;
+    }
+
+    if(y + count > (int)graphics_mode->VerticalResolution) {
+        count = graphics_mode->VerticalResolution - y;
+    }
+
+    if(width <= 0 || count <= 0) {
+        return;
+    }
+
+    if(!framebuffer) {
+        for(int i = 0; i < count; i++) {
+            graphics->Blt(graphics, (EFI_GRAPHICS_OUTPUT_BLT_PIXEL*)pixels, EfiBltBufferToVideo,
+                0, 0, x, y + i, width, 1, 0);
+        }
+        return;
+    }
+
+    UINT32* line = framebuffer + (UINTN)y * graphics_mode->PixelsPerScanLine + x;
+    for(int i = 0; i < count; i++) {
+        for(int p = 0; p < width; p++) {
+            line[p] = pixels[p];
+        }
+
+        line += graphics_mode->PixelsPerScanLine;
+    }
+}
+
+int init_graphics(EFI_BOOT_SERVICES* bootServices) {
+    EFI_GUID guid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
+    if(EFI_ERROR(bootServices->LocateProtocol(&guid, NULL, (VOID**)&graphics))) {
+        return 0;
+    }
+
+    graphics_mode = graphics->Mode->Info;
+    if(graphics_mode->PixelFormat != PixelBltOnly) {
+        framebuffer = (UINT32*)graphics->Mode->FrameBufferBase;
+    }
+
+    // Clear whatever the firmware left on the screen
+    EFI_GRAPHICS_OUTPUT_BLT_PIXEL black = {0};
+    graphics->Blt(graphics, &black, EfiBltVideoFill, 0, 0, 0, 0,
+        graphics_mode->HorizontalResolution, graphics_mode->VerticalResolution, 0);
+
+    return 1;
+}
+
+#endif
+
 EFI_STATUS efi_main(EFI_HANDLE handle, EFI_SYSTEM_TABLE* systemTbl) {
     console = systemTbl->ConOut;
     output_string = console->OutputString;
@@ -30,6 +134,15 @@ EFI_STATUS efi_main(EFI_HANDLE handle, EFI_SYSTEM_TABLE* systemTbl) {
 
     stall = systemTbl->BootServices->Stall;
 
+    calibrate_tsc();
+
+#ifdef USE_FRAMEBUFFER
+    if(!init_graphics(systemTbl->BootServices)) {
+        print_text(L"Graphics output is not available!\r\n");
+        return EFI_UNSUPPORTED;
+    }
+#endif
+
     play_frames();
 
     return 0;
@@ -0,0 +1,89 @@
+#include "frame.h"
+
+#include "logger.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include <exception>
+
+#include <sys/mman.h>
+
+// Arenas at least this big are worth putting in huge pages
+#define FRAME_POOL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+void FrameReleaser::operator()(Frame* frame) const {
+    frame->pool->release(frame);
+}
+
+FramePool::FramePool(int width, int height, int count)
+    : m_frameSize(width * height), m_frames(count) {
+    assert(width > 0 && height > 0 && count > 0);
+
+    // Each buffer starts on its own cache line
+    size_t stride = (m_frameSize + FRAME_BUFFER_ALIGNMENT - 1) & ~(size_t)(FRAME_BUFFER_ALIGNMENT - 1);
+    m_arenaSize = stride * count;
+
+    void* arena = MAP_FAILED;
+    if(m_arenaSize >= FRAME_POOL_HUGE_PAGE_SIZE) {
+        // Only works if huge pages have been reserved, which they usually aren't
+        size_t hugeSize = (m_arenaSize + FRAME_POOL_HUGE_PAGE_SIZE - 1) & ~(size_t)(FRAME_POOL_HUGE_PAGE_SIZE - 1);
+        arena = mmap(nullptr, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(arena != MAP_FAILED) {
+            m_arenaSize = hugeSize;
+        }
+    }
+
+    if(arena == MAP_FAILED) {
+        // Pages are always aligned well beyond FRAME_BUFFER_ALIGNMENT
+        arena = mmap(nullptr, m_arenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(arena == MAP_FAILED) {
+            Logger::Error("Failed to allocate {} bytes for frames: {}", m_arenaSize, strerror(errno));
+            std::terminate();
+        }
+
+        // Otherwise let the kernel use transparent huge pages
+        if(m_arenaSize >= FRAME_POOL_HUGE_PAGE_SIZE) {
+            madvise(arena, m_arenaSize, MADV_HUGEPAGE);
+        }
+    }
+
+    m_arena = (uint8_t*)arena;
+
+    m_freeFrames.reserve(count);
+    for(int i = count - 1; i >= 0; i--) {
+        Frame& frame = m_frames[i];
+        frame.data = m_arena + i * stride;
+        frame.usTimestamp = 0;
+        frame.pool = this;
+
+        m_freeFrames.push_back(&frame);
+    }
+}
+
+FramePool::~FramePool() {
+    // Every handle should have been released by now
+    assert(m_freeFrames.size() == m_frames.size());
+
+    munmap(m_arena, m_arenaSize);
+}
+
+FrameHandle FramePool::acquire() {
+    std::unique_lock lock{m_lock};
+    if(m_freeFrames.empty()) {
+        return nullptr;
+    }
+
+    Frame* frame = m_freeFrames.back();
+    m_freeFrames.pop_back();
+
+    return FrameHandle(frame);
+}
+
+void FramePool::release(Frame* frame) {
+    std::unique_lock lock{m_lock};
+
+    // Never grows past the capacity reserved in the constructor
+    m_freeFrames.push_back(frame);
+}
@@ -1,23 +1,62 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Frame buffers start on a cache line so vector loads never straddle two
+#define FRAME_BUFFER_ALIGNMENT 64
+
+class FramePool;
 
 struct Frame {
     // Actual pixel data of the frame
     uint8_t* data;
     // Timestamp of the frame in microseconds
     long usTimestamp;
+
+    // Pool the frame goes back to once released
+    FramePool* pool;
 };
 
-template<typename Pixel>
-inline Pixel* allocate_frame_buffer(int width, int height) {
-    Pixel* buffer = new Pixel[width*height];
+struct FrameReleaser {
+    void operator()(Frame* frame) const;
+};
+
+// Owns a frame from a pool, giving it back when destroyed
+using FrameHandle = std::unique_ptr<Frame, FrameReleaser>;
+
+// Every frame buffer is allocated up front from one arena, so handing frames
+// between the decoder and an output doesn't allocate. Decoding can still
+// allocate in libav, and the frames source allocates while loading each PNG.
+// Arenas big enough are backed by huge pages when possible
+class FramePool {
+public:
+    FramePool(int width, int height, int count);
+    ~FramePool();
+
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
 
-    return buffer;
-}
+    // Returns nullptr if every frame is in use
+    FrameHandle acquire();
 
-static inline void free_frame(Frame* frame) {
-    if(frame->data)
-        delete frame->data;
-    delete frame;
-}
+    // Size of each frame's pixel data
+    inline size_t frame_size() const { return m_frameSize; }
+
+private:
+    friend struct FrameReleaser;
+    void release(Frame* frame);
+
+    size_t m_frameSize;
+
+    uint8_t* m_arena;
+    size_t m_arenaSize;
+
+    std::vector<Frame> m_frames;
+
+    std::mutex m_lock;
+    std::vector<Frame*> m_freeFrames;
+};
@@ -0,0 +1,79 @@
+#include "frame_cache.h"
+
+#include "frame_pack.h"
+#include "image.h"
+#include "logger.h"
+#include "paths.h"
+#include "stream_context.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
+#include <sys/stat.h>
+
+// Bump when anything about how frames are decoded changes
+#define FRAME_CACHE_VERSION 1
+
+// Bytes hashed from each end of the video, hashing the whole
+// thing would take a good part of the time saved by the cache
+#define FRAME_CACHE_SAMPLE_SIZE 0x10000
+
+template<typename T>
+static uint64_t hash_value(uint64_t hash, const T& value) {
+    return hash_bytes(hash, std::string_view((const char*)&value, sizeof(value)));
+}
+
+std::string frame_cache_path(const char* videoPath, int width, int height) {
+    struct stat st;
+    if(stat(videoPath, &st)) {
+        return "";
+    }
+
+    FILE* video = fopen(videoPath, "rb");
+    if(!video) {
+        return "";
+    }
+
+    // The size and modification time catch most changes,
+    // the start and end of the file catch the rest
+    std::vector<char> sample(FRAME_CACHE_SAMPLE_SIZE);
+    size_t headSize = fread(sample.data(), 1, sample.size(), video);
+    uint64_t hash = hash_bytes(HASH_BYTES_INITIAL, std::string_view(sample.data(), headSize));
+
+    if(st.st_size > FRAME_CACHE_SAMPLE_SIZE) {
+        fseek(video, -std::min<long>(st.st_size - FRAME_CACHE_SAMPLE_SIZE, FRAME_CACHE_SAMPLE_SIZE), SEEK_END);
+        size_t tailSize = fread(sample.data(), 1, sample.size(), video);
+        hash = hash_bytes(hash, std::string_view(sample.data(), tailSize));
+    }
+
+    bool failed = ferror(video);
+    fclose(video);
+    if(failed) {
+        Logger::Warning("Error reading '{}': {}", videoPath, strerror(errno));
+        return "";
+    }
+
+    hash = hash_value(hash, (int64_t)st.st_size);
+    hash = hash_value(hash, (int64_t)st.st_mtim.tv_sec);
+    hash = hash_value(hash, (int64_t)st.st_mtim.tv_nsec);
+
+    // Everything else which changes the decoded frames
+    hash = hash_value(hash, FRAME_CACHE_VERSION);
+    hash = hash_value(hash, FRAME_PACK_VERSION);
+    hash = hash_value(hash, width);
+    hash = hash_value(hash, height);
+    hash = hash_value(hash, StreamContext::rescaler_flags());
+    hash = hash_value(hash, MONOCHROME_MASK);
+
+    std::string cacheDir = get_cache_dir();
+    if(cacheDir.empty()) {
+        return "";
+    }
+
+    return fmt::format("{}/frames-{:016x}.pack", cacheDir, hash);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <string>
+
+// Decoded videos are cached as frame packs in the cache directory.
+// Returns where the frames of videoPath scaled to width x height are cached,
+// or an empty string if they can't be
+std::string frame_cache_path(const char* videoPath, int width, int height);
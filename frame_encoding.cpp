@@ -0,0 +1,272 @@
+#include "frame_encoding.h"
+
+#include <cstring>
+
+// Shortest run worth encoding as a repeat in the middle of literals
+#define RLE_MIN_RUN 3
+#define RLE_MAX_RUN 128
+#define RLE_MAX_LITERALS 128
+
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (127 + LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS 128
+#define LZ_MAX_OFFSET 0xffff
+// How many earlier positions with the same hash to try for each match
+#define LZ_MAX_CHAIN 32
+#define LZ_HASH_BITS 12
+
+// Longest span of unchanged bytes that is still cheaper to XOR in
+// than to end the span and start a new one
+#define DELTA_MAX_GAP 2
+
+void encode_delta(const uint8_t* previous, const uint8_t* current, unsigned size,
+                  std::vector<uint8_t>& out) {
+    auto changed = [&](unsigned i) -> bool { return previous[i] != current[i]; };
+
+    unsigned pos = 0;
+    while(pos < size) {
+        unsigned skip = 0;
+        while(pos + skip < size && skip < 255 && !changed(pos + skip)) {
+            skip++;
+        }
+        pos += skip;
+
+        unsigned count = 0;
+        while(pos + count < size && count < 255) {
+            if(changed(pos + count)) {
+                count++;
+                continue;
+            }
+
+            // Absorb short gaps if there is more changed data straight after
+            unsigned gap = 1;
+            while(gap <= DELTA_MAX_GAP && pos + count + gap < size && !changed(pos + count + gap)) {
+                gap++;
+            }
+
+            if(gap > DELTA_MAX_GAP || pos + count + gap >= size || count + gap >= 255) {
+                break;
+            }
+
+            count += gap;
+        }
+
+        out.push_back(skip);
+        out.push_back(count);
+        for(unsigned i = 0; i < count; i++) {
+            out.push_back(previous[pos + i] ^ current[pos + i]);
+        }
+        pos += count;
+    }
+}
+
+const uint8_t* apply_delta(uint8_t* frame, unsigned size, const uint8_t* delta, size_t deltaSize) {
+    uint8_t* end = frame + size;
+    const uint8_t* deltaEnd = delta + deltaSize;
+    while(frame < end) {
+        if(deltaEnd - delta < 2) {
+            return nullptr;
+        }
+
+        unsigned skip = *(delta++);
+        unsigned count = *(delta++);
+        if(skip > end - frame || count > end - frame - skip || count > deltaEnd - delta) {
+            return nullptr;
+        }
+
+        frame += skip;
+        while(count--) {
+            *(frame++) ^= *(delta++);
+        }
+    }
+
+    return delta;
+}
+
+void compress_rle(const uint8_t* data, unsigned size, std::vector<uint8_t>& out) {
+    auto runAt = [&](unsigned i) -> unsigned {
+        unsigned run = 1;
+        while(i + run < size && run < RLE_MAX_RUN && data[i + run] == data[i]) {
+            run++;
+        }
+        return run;
+    };
+
+    unsigned i = 0;
+    while(i < size) {
+        unsigned run = runAt(i);
+        if(run >= 2) {
+            // A run of 2 costs the same as 2 literals
+            // but saves starting a literal block
+            out.push_back(257 - run);
+            out.push_back(data[i]);
+            i += run;
+            continue;
+        }
+
+        unsigned end = i + 1;
+        while(end < size && end - i < RLE_MAX_LITERALS && runAt(end) < RLE_MIN_RUN) {
+            end++;
+        }
+
+        out.push_back(end - i - 1);
+        out.insert(out.end(), data + i, data + end);
+        i = end;
+    }
+}
+
+void compress_lz(const uint8_t* data, unsigned size, std::vector<uint8_t>& out) {
+    // Most recent position for each hash and the previous position
+    // with the same hash for each position
+    std::vector<int> head(1 << LZ_HASH_BITS, -1);
+    std::vector<int> chain(size, -1);
+
+    auto hashAt = [&](unsigned i) -> unsigned {
+        uint32_t v = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16);
+        return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+    };
+
+    auto insert = [&](unsigned i) {
+        if(i + LZ_MIN_MATCH <= size) {
+            unsigned h = hashAt(i);
+            chain[i] = head[h];
+            head[h] = i;
+        }
+    };
+
+    unsigned literalStart = 0;
+    auto flushLiterals = [&](unsigned end) {
+        while(literalStart < end) {
+            unsigned count = end - literalStart;
+            if(count > LZ_MAX_LITERALS) {
+                count = LZ_MAX_LITERALS;
+            }
+
+            out.push_back(count - 1);
+            out.insert(out.end(), data + literalStart, data + literalStart + count);
+            literalStart += count;
+        }
+    };
+
+    unsigned i = 0;
+    while(i < size) {
+        unsigned bestLength = 0;
+        unsigned bestOffset = 0;
+
+        if(i + LZ_MIN_MATCH <= size) {
+            int candidate = head[hashAt(i)];
+            for(int depth = 0; candidate >= 0 && depth < LZ_MAX_CHAIN; depth++) {
+                unsigned offset = i - candidate;
+                if(offset > LZ_MAX_OFFSET) {
+                    break;
+                }
+
+                unsigned length = 0;
+                while(i + length < size && length < LZ_MAX_MATCH && data[candidate + length] == data[i + length]) {
+                    length++;
+                }
+
+                if(length > bestLength) {
+                    bestLength = length;
+                    bestOffset = offset;
+                }
+
+                candidate = chain[candidate];
+            }
+        }
+
+        if(bestLength < LZ_MIN_MATCH) {
+            insert(i++);
+            continue;
+        }
+
+        flushLiterals(i);
+
+        out.push_back(0x80 | (bestLength - LZ_MIN_MATCH));
+        out.push_back(bestOffset & 0xff);
+        out.push_back(bestOffset >> 8);
+
+        for(unsigned j = 0; j < bestLength; j++) {
+            insert(i + j);
+        }
+        i += bestLength;
+        literalStart = i;
+    }
+
+    flushLiterals(size);
+}
+
+const uint8_t* decompress_rle(const uint8_t* in, size_t inSize, uint8_t* out, unsigned size) {
+    const uint8_t* inEnd = in + inSize;
+    uint8_t* end = out + size;
+    while(out < end) {
+        if(in == inEnd) {
+            return nullptr;
+        }
+
+        uint8_t n = *(in++);
+        if(n < 128) {
+            unsigned count = n + 1;
+            if(count > end - out || count > inEnd - in) {
+                return nullptr;
+            }
+
+            memcpy(out, in, count);
+            out += count;
+            in += count;
+        } else if(n > 128) {
+            unsigned count = 257 - n;
+            if(count > end - out || in == inEnd) {
+                return nullptr;
+            }
+
+            memset(out, *(in++), count);
+            out += count;
+        }
+    }
+
+    return in;
+}
+
+const uint8_t* decompress_lz(const uint8_t* in, size_t inSize, uint8_t* out, unsigned size) {
+    const uint8_t* inEnd = in + inSize;
+    uint8_t* start = out;
+    uint8_t* end = out + size;
+    while(out < end) {
+        if(in == inEnd) {
+            return nullptr;
+        }
+
+        uint8_t t = *(in++);
+        if(t < 0x80) {
+            unsigned count = t + 1;
+            if(count > end - out || count > inEnd - in) {
+                return nullptr;
+            }
+
+            memcpy(out, in, count);
+            out += count;
+            in += count;
+        } else {
+            if(inEnd - in < 2) {
+                return nullptr;
+            }
+
+            unsigned length = (t & 0x7f) + LZ_MIN_MATCH;
+            unsigned offset = in[0] | (in[1] << 8);
+            in += 2;
+
+            if(!offset || offset > out - start || length > end - out) {
+                return nullptr;
+            }
+
+            // The match may overlap with itself so copy one byte at a time
+            const uint8_t* match = out - offset;
+            while(length--) {
+                *(out++) = *(match++);
+            }
+        }
+    }
+
+    return in;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Encodes the difference between two packed frames as spans of XORed bytes.
+// Each span is an 8-bit count of unchanged bytes to skip, followed by an
+// 8-bit count of bytes to XOR into the previous frame and then those bytes.
+// Spans continue until the whole frame is covered.
+void encode_delta(const uint8_t* previous, const uint8_t* current, unsigned size,
+                  std::vector<uint8_t>& out);
+
+// Applies a delta of deltaSize bytes produced by encode_delta to frame in place,
+// returns a pointer to the end of the delta or nullptr if it is malformed
+const uint8_t* apply_delta(uint8_t* frame, unsigned size, const uint8_t* delta, size_t deltaSize);
+
+// Intra-frame compression applied to the packed frame,
+// or the XOR of it with the previous frame when using delta frames
+enum class FrameCompression {
+    None,
+    // PackBits style run-length encoding.
+    // A header byte n of 0 to 127 is followed by n + 1 literal bytes,
+    // 129 to 255 repeats the next byte 257 - n times and 128 is skipped.
+    RLE,
+    // Small LZ77 variant.
+    // A token t below 128 is followed by t + 1 literal bytes,
+    // otherwise (t & 127) + 3 bytes are copied from a 16-bit little endian
+    // offset back in the output, which may overlap with the bytes being copied.
+    LZ,
+};
+
+void compress_rle(const uint8_t* data, unsigned size, std::vector<uint8_t>& out);
+void compress_lz(const uint8_t* data, unsigned size, std::vector<uint8_t>& out);
+
+// Decompresses exactly size bytes into out from inSize bytes of compressed data,
+// returns a pointer to the end of the compressed data or nullptr if it is malformed.
+// Nothing is read or written outside of either buffer whatever the input
+const uint8_t* decompress_rle(const uint8_t* in, size_t inSize, uint8_t* out, unsigned size);
+const uint8_t* decompress_lz(const uint8_t* in, size_t inSize, uint8_t* out, unsigned size);
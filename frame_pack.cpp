@@ -0,0 +1,255 @@
+#include "frame_pack.h"
+
+#include "frame_encoding.h"
+#include "image.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+FramePack::~FramePack() {
+    if(m_data) {
+        munmap((void*)m_data, m_size);
+    }
+}
+
+int FramePack::open(const char* path) {
+    m_path = path;
+
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        Logger::Error("Failed to open '{}': {}!", path, strerror(errno));
+        return 1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st)) {
+        Logger::Error("Failed to stat '{}': {}!", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    if((size_t)st.st_size < sizeof(FramePackHeader)) {
+        Logger::Error("'{}' is not a frame pack!", path);
+        close(fd);
+        return 1;
+    }
+
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(mapping == MAP_FAILED) {
+        Logger::Error("Failed to map '{}': {}!", path, strerror(errno));
+        return 1;
+    }
+
+    m_data = (const uint8_t*)mapping;
+    m_size = st.st_size;
+    memcpy(&m_header, m_data, sizeof(m_header));
+    m_header.version = le32(m_header.version);
+    m_header.width = le32(m_header.width);
+    m_header.height = le32(m_header.height);
+    m_header.flags = le32(m_header.flags);
+    m_header.compression = le32(m_header.compression);
+    m_header.keyframeInterval = le32(m_header.keyframeInterval);
+    m_header.frameCount = le32(m_header.frameCount);
+    m_header.frameInterval = le32(m_header.frameInterval);
+    m_header.indexOffset = le64(m_header.indexOffset);
+
+    if(memcmp(m_header.magic, FRAME_PACK_MAGIC, sizeof(FRAME_PACK_MAGIC))) {
+        Logger::Error("'{}' is not a frame pack!", path);
+        return 1;
+    }
+
+    if(m_header.version != FRAME_PACK_VERSION) {
+        Logger::Error("'{}' is frame pack version {}, expected {}!", path, m_header.version, FRAME_PACK_VERSION);
+        return 1;
+    }
+
+    bool interlaced = m_header.flags & FRAME_PACK_INTERLACED;
+    if(!m_header.width || !m_header.height || m_header.width > 0x10000 || m_header.height > 0x10000
+            || (interlaced && m_header.height % 4)
+            || m_header.compression > (uint32_t)FrameCompression::LZ) {
+        Logger::Error("'{}' has an invalid header!", path);
+        return 1;
+    }
+
+    if(m_header.indexOffset > m_size
+            || (m_size - m_header.indexOffset) / sizeof(FramePackEntry) < m_header.frameCount
+            || m_header.indexOffset % alignof(FramePackEntry)) {
+        Logger::Error("'{}' is truncated!", path);
+        return 1;
+    }
+
+    m_index = (const FramePackEntry*)(m_data + m_header.indexOffset);
+    for(unsigned i = 0; i < m_header.frameCount; i++) {
+        uint64_t offset = le64(m_index[i].offset);
+        if(offset > m_size || le32(m_index[i].size) > m_size - offset) {
+            Logger::Error("'{}' is truncated!", path);
+            return 1;
+        }
+    }
+
+    m_fieldCount = interlaced ? 2 : 1;
+    m_packedSize = ((width() + 7) / 8) * height() / m_fieldCount;
+
+    for(auto& reference : m_references) {
+        reference.assign(m_packedSize, 0);
+    }
+    m_decompressed.resize(m_packedSize);
+
+    return 0;
+}
+
+long FramePack::duration() const {
+    if(!frame_count()) {
+        return 0;
+    }
+
+    return frame_timestamp(frame_count() - 1) + frame_interval();
+}
+
+int FramePack::frame_at(long usTimestamp) const {
+    const FramePackEntry* end = m_index + frame_count();
+    const FramePackEntry* entry = std::upper_bound(m_index, end, usTimestamp,
+        [](long timestamp, const FramePackEntry& e) { return timestamp < (int64_t)le64(e.usTimestamp); });
+
+    return std::max(0, (int)(entry - m_index) - 1);
+}
+
+bool FramePack::apply_frame(int index) {
+    const FramePackEntry& entry = m_index[index];
+    // Checked against the size of the file by open
+    const uint8_t* data = m_data + le64(entry.offset);
+    size_t size = le32(entry.size);
+    uint8_t* reference = m_references[index % m_fieldCount].data();
+
+    bool delta = m_header.flags & FRAME_PACK_DELTA;
+    FrameCompression compression = (FrameCompression)m_header.compression;
+
+    if(compression == FrameCompression::None) {
+        if(delta) {
+            return apply_delta(reference, m_packedSize, data, size) != nullptr;
+        }
+
+        if(size < m_packedSize) {
+            return false;
+        }
+
+        memcpy(reference, data, m_packedSize);
+        return true;
+    }
+
+    const uint8_t* end;
+    if(compression == FrameCompression::RLE) {
+        end = decompress_rle(data, size, m_decompressed.data(), m_packedSize);
+    } else {
+        end = decompress_lz(data, size, m_decompressed.data(), m_packedSize);
+    }
+
+    if(!end) {
+        return false;
+    }
+
+    if(delta) {
+        // Compressed delta frames are the XOR of the two frames
+        for(unsigned i = 0; i < m_packedSize; i++) {
+            reference[i] ^= m_decompressed[i];
+        }
+    } else {
+        memcpy(reference, m_decompressed.data(), m_packedSize);
+    }
+
+    return true;
+}
+
+int FramePack::verify() {
+    for(int i = 0; i < frame_count(); i++) {
+        if(!decode_field(i)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+bool FramePack::decode_field(int index) {
+    int field = index % m_fieldCount;
+    if(m_decodedFrames[field] == index) {
+        return true;
+    }
+
+    int start = index;
+    if(m_header.flags & FRAME_PACK_DELTA) {
+        // First frame of the field encoded against a blank one
+        int keyframe = field;
+        if(m_header.keyframeInterval) {
+            int fieldFrame = index / m_fieldCount;
+            keyframe = fieldFrame / m_header.keyframeInterval * m_header.keyframeInterval * m_fieldCount + field;
+        }
+
+        if(m_decodedFrames[field] >= keyframe && m_decodedFrames[field] < index) {
+            // Carry on from the last frame
+            start = m_decodedFrames[field] + m_fieldCount;
+        } else {
+            start = keyframe;
+            std::fill(m_references[field].begin(), m_references[field].end(), 0);
+        }
+    }
+
+    for(int i = start; i <= index; i += m_fieldCount) {
+        if(!apply_frame(i)) {
+            // The reference is only partly decoded
+            m_decodedFrames[field] = -1;
+            Logger::Error("Frame {} of '{}' is corrupt!", i, m_path);
+            return false;
+        }
+    }
+
+    m_decodedFrames[field] = index;
+    return true;
+}
+
+int FramePack::decode_frame(int index, uint8_t* pixels) {
+    int stride = (width() + 7) / 8;
+
+    if(!decode_field(index)) {
+        return 1;
+    }
+
+    if(m_fieldCount == 1) {
+        for(int i = 0; i < height(); i++) {
+            unpack_monochrome_pxls(pixels + i * width(), m_references[0].data() + i * stride, width());
+        }
+        return 0;
+    }
+
+    // The other lines come from the frame before
+    int other = (index + 1) % 2;
+    if(index > 0) {
+        if(!decode_field(index - 1)) {
+            return 1;
+        }
+    } else {
+        std::fill(m_references[other].begin(), m_references[other].end(), 0);
+        m_decodedFrames[other] = -1;
+    }
+
+    // Each line of text is two rows of pixels,
+    // lines alternate between the fields
+    for(int line = 0; line < height() / 2; line++) {
+        const uint8_t* packed = m_references[line % 2].data() + (line / 2) * 2 * stride;
+
+        unpack_monochrome_pxls(pixels + line * 2 * width(), packed, width());
+        unpack_monochrome_pxls(pixels + (line * 2 + 1) * width(), packed + stride, width());
+    }
+
+    return 0;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Frame packs hold the packed monochrome frames produced by COutput
+// so they can be played back without decoding the video again.
+//
+// The file starts with a FramePackHeader, followed by the encoded frames
+// and then an index of frameCount FramePackEntry structures at indexOffset.
+// Everything is little endian.
+
+#define FRAME_PACK_MAGIC "TTYPACK"
+#define FRAME_PACK_VERSION 1
+
+// Frames are delta encoded against the previous frame of the same field
+#define FRAME_PACK_DELTA 0x1
+// Each frame only has every other line of text, see Output::set_interlacing
+#define FRAME_PACK_INTERLACED 0x2
+
+struct FramePackHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t flags;
+    // FrameCompression of each frame
+    uint32_t compression;
+    // Delta frames are encoded against a blank frame every keyframeInterval
+    // frames of each field, 0 if only the first frames are
+    uint32_t keyframeInterval;
+    uint32_t frameCount;
+    // Average time between frames in microseconds
+    uint32_t frameInterval;
+    uint64_t indexOffset;
+};
+
+static_assert(sizeof(FramePackHeader) == 48);
+
+struct FramePackEntry {
+    uint64_t offset;
+    // Time since the first frame in microseconds
+    int64_t usTimestamp;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(FramePackEntry) == 24);
+
+// Convert between little endian and the host byte order,
+// does nothing on little endian hosts
+inline uint32_t le32(uint32_t value) {
+    if constexpr(std::endian::native == std::endian::big) {
+        return __builtin_bswap32(value);
+    }
+    return value;
+}
+
+inline uint64_t le64(uint64_t value) {
+    if constexpr(std::endian::native == std::endian::big) {
+        return __builtin_bswap64(value);
+    }
+    return value;
+}
+
+// Memory maps a frame pack and decodes frames from it
+class FramePack {
+public:
+    ~FramePack();
+
+    // Returns 0 on success
+    int open(const char* path);
+
+    inline int width() const { return m_header.width; }
+    inline int height() const { return m_header.height; }
+    inline int frame_count() const { return m_header.frameCount; }
+    inline long frame_interval() const { return m_header.frameInterval; }
+
+    inline long frame_timestamp(int index) const { return (int64_t)le64(m_index[index].usTimestamp); }
+    // Time from the first frame until the end of the last
+    long duration() const;
+    // Last frame shown at usTimestamp
+    int frame_at(long usTimestamp) const;
+
+    // Decodes frame index to width * height gray pixels.
+    // Frames which follow the last one decoded are quick,
+    // otherwise decoding starts again from the closest keyframe.
+    // Returns 0 on success or 1 if the frame data is corrupt
+    int decode_frame(int index, uint8_t* pixels);
+    // Decodes every frame to check none are corrupt,
+    // returns 0 if they all decode
+    int verify();
+
+private:
+    // Brings the reference for the field of index up to frame index,
+    // returns false if the frame data is corrupt
+    bool decode_field(int index);
+    // Decodes frame index over the previous frame of its field,
+    // returns false if its data is corrupt
+    bool apply_frame(int index);
+
+    std::string m_path;
+
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+
+    // Copy of the header in host byte order
+    FramePackHeader m_header = {};
+    // Entries are used straight from the mapping, so still little endian
+    const FramePackEntry* m_index = nullptr;
+
+    int m_fieldCount = 1;
+    // Packed size of each frame
+    unsigned m_packedSize;
+
+    // Packed pixels of the last frame decoded for each field
+    std::vector<uint8_t> m_references[2];
+    int m_decodedFrames[2] = {-1, -1};
+    std::vector<uint8_t> m_decompressed;
+};
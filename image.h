@@ -26,10 +26,11 @@ std::vector<Pixel> downscale_image(Pixel** rows, int sourceWidth, int sourceHeig
 
 // For now just mask the highest 3-bits to determine whether to treat a gray
 // as white or black
-#define GRAY_TO_MONOCHROME(x) (x & 0xc0)
+#define MONOCHROME_MASK 0xc0
+#define GRAY_TO_MONOCHROME(x) (x & MONOCHROME_MASK)
 
 // Packs up to 8 gray pixels into an 8-bit integer
-static inline void pack_monochrome_pxls(uint8_t* buffer, uint8_t* grayPixels, unsigned amount) {
+static inline void pack_monochrome_pxls(uint8_t* buffer, const uint8_t* grayPixels, unsigned amount) {
     uint8_t packed = 0;
     while(amount >= 8) {
         packed = 0;
@@ -48,6 +49,10 @@ static inline void pack_monochrome_pxls(uint8_t* buffer, uint8_t* grayPixels, un
         amount -= 8;
     }
 
+    if(!amount) {
+        return;
+    }
+
     packed = 0;
     while(amount--) {
         packed <<= 1;
@@ -59,3 +64,28 @@ static inline void pack_monochrome_pxls(uint8_t* buffer, uint8_t* grayPixels, un
     }
     *buffer = packed;
 }
+
+// Unpacks amount pixels packed by pack_monochrome_pxls into white or black gray pixels
+static inline void unpack_monochrome_pxls(uint8_t* grayPixels, const uint8_t* buffer, unsigned amount) {
+    uint8_t packed;
+    while(amount >= 8) {
+        packed = *(buffer++);
+
+        int i = 8;
+        while(i--) {
+            *(grayPixels++) = ((packed >> i) & 1) ? 0xff : 0;
+        }
+
+        amount -= 8;
+    }
+
+    if(!amount) {
+        return;
+    }
+
+    // The last pixels are in the low bits
+    packed = *buffer;
+    while(amount--) {
+        *(grayPixels++) = ((packed >> amount) & 1) ? 0xff : 0;
+    }
+}
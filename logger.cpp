@@ -0,0 +1,254 @@
+#include "logger.h"
+
+#include <cerrno>
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+// Number of messages that can be waiting to be written,
+// any more are dropped rather than blocking the caller
+#define LOGGER_RING_SIZE 256
+// Longer messages are cut short
+#define LOGGER_MESSAGE_SIZE 1024
+
+namespace Logger {
+
+static const char* levelNames[] = {
+    "Debug",
+    "Warning",
+    "Error",
+};
+
+// Bounded multi-producer queue, each slot's sequence says whether
+// it is free for the producer at that position (== position)
+// or holds a message for the consumer (== position + 1)
+struct Slot {
+    std::atomic<uint64_t> sequence;
+    unsigned size;
+    char text[LOGGER_MESSAGE_SIZE];
+};
+
+class LoggerThread {
+public:
+    LoggerThread() {
+        for(uint64_t i = 0; i < LOGGER_RING_SIZE; i++) {
+            m_ring[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~LoggerThread() {
+        if(!m_thread.joinable()) {
+            return;
+        }
+
+        // The logger thread only exists in the parent
+        if(m_forked) {
+            m_thread.detach();
+            return;
+        }
+
+        // Anything logged from here on is written straight away
+        m_running.store(false, std::memory_order_release);
+        wait_for_written(m_writeIndex.load(std::memory_order_acquire));
+
+        m_stop.store(true, std::memory_order_release);
+        m_published.fetch_add(1, std::memory_order_release);
+        m_published.notify_one();
+
+        m_thread.join();
+    }
+
+    void start() {
+        std::call_once(m_started, [this] {
+            // Signals are left to the other threads
+            sigset_t signals, oldSignals;
+            sigfillset(&signals);
+            pthread_sigmask(SIG_BLOCK, &signals, &oldSignals);
+
+            m_thread = std::thread(&LoggerThread::run, this);
+
+            pthread_sigmask(SIG_SETMASK, &oldSignals, nullptr);
+            m_running.store(true, std::memory_order_release);
+        });
+    }
+
+    // Returns false if there is no room
+    bool push(Level level, fmt::string_view format, fmt::format_args args) {
+        uint64_t position = m_writeIndex.load(std::memory_order_relaxed);
+
+        Slot* slot;
+        while(true) {
+            slot = &m_ring[position % LOGGER_RING_SIZE];
+            uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+
+            if(sequence == position) {
+                if(m_writeIndex.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if(sequence < position) {
+                // Still holds a message from the last time around
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                position = m_writeIndex.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->size = format_message(slot->text, level, format, args);
+        slot->sequence.store(position + 1, std::memory_order_release);
+
+        m_published.fetch_add(1, std::memory_order_release);
+        m_published.notify_one();
+        return true;
+    }
+
+    void flush() {
+        if(m_running.load(std::memory_order_acquire)) {
+            wait_for_written(m_writeIndex.load(std::memory_order_acquire));
+        }
+    }
+
+    bool is_running() const {
+        return m_running.load(std::memory_order_acquire);
+    }
+
+    // Only the thread calling fork is copied into the child, anything logged
+    // there is written straight away instead of waiting on a thread that isn't there
+    void forked() {
+        m_forked = true;
+        m_running.store(false, std::memory_order_release);
+    }
+
+    static unsigned format_message(char* buffer, Level level, fmt::string_view format, fmt::format_args args) {
+        // Leave room for the newline
+        char* end = buffer + LOGGER_MESSAGE_SIZE - 1;
+
+        auto result = fmt::format_to_n(buffer, end - buffer, "[{}] [{}] ", "terminal_apple", levelNames[(int)level]);
+        char* out = std::min(result.out, end);
+
+        result = fmt::vformat_to_n(out, end - out, format, args);
+        out = std::min(result.out, end);
+
+        *out++ = '\n';
+        return out - buffer;
+    }
+
+    static void write_all(const char* data, size_t size) {
+        while(size) {
+            ssize_t written = write(STDERR_FILENO, data, size);
+            if(written < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+
+            data += written;
+            size -= written;
+        }
+    }
+
+private:
+    void wait_for_written(uint64_t target) {
+        uint64_t written = m_written.load(std::memory_order_acquire);
+        while(written < target) {
+            m_written.wait(written, std::memory_order_acquire);
+            written = m_written.load(std::memory_order_acquire);
+        }
+    }
+
+    void run() {
+        uint64_t readIndex = 0;
+        uint32_t published = 0;
+
+        while(true) {
+            Slot& slot = m_ring[readIndex % LOGGER_RING_SIZE];
+            if(slot.sequence.load(std::memory_order_acquire) != readIndex + 1) {
+                if(m_stop.load(std::memory_order_acquire)) {
+                    return;
+                }
+
+                // A message may have been published into a later slot
+                // before this one was filled in
+                uint32_t current = m_published.load(std::memory_order_acquire);
+                if(current == published) {
+                    m_published.wait(current, std::memory_order_acquire);
+                } else {
+                    std::this_thread::yield();
+                }
+
+                published = current;
+                continue;
+            }
+
+            write_all(slot.text, slot.size);
+
+            slot.sequence.store(readIndex + LOGGER_RING_SIZE, std::memory_order_release);
+            readIndex++;
+
+            m_written.store(readIndex, std::memory_order_release);
+            m_written.notify_all();
+
+            if(uint64_t dropped = m_dropped.exchange(0, std::memory_order_relaxed)) {
+                char buffer[LOGGER_MESSAGE_SIZE];
+                fmt::string_view format = "{} messages were dropped";
+                write_all(buffer, format_message(buffer, Level::Warning, format, fmt::make_format_args(dropped)));
+            }
+        }
+    }
+
+    Slot m_ring[LOGGER_RING_SIZE];
+
+    std::atomic<uint64_t> m_writeIndex = 0;
+    // Number of messages written by the logger thread
+    std::atomic<uint64_t> m_written = 0;
+    // Increased every time a message is queued, for the logger thread to wait on
+    std::atomic<uint32_t> m_published = 0;
+    std::atomic<uint64_t> m_dropped = 0;
+
+    std::atomic<bool> m_running = false;
+    std::atomic<bool> m_stop = false;
+    bool m_forked = false;
+
+    std::once_flag m_started;
+    std::thread m_thread;
+};
+
+static LoggerThread logger;
+
+static void forked_child() {
+    logger.forked();
+}
+
+static int registerForkHandler = pthread_atfork(nullptr, nullptr, forked_child);
+
+void log(Level level, fmt::string_view format, fmt::format_args args) {
+    if(level < Level::Error) {
+        logger.start();
+        if(logger.is_running() && logger.push(level, format, args)) {
+            return;
+        }
+
+        // Nothing is written when the queue is full,
+        // the logger thread says how many messages were dropped
+        if(logger.is_running()) {
+            return;
+        }
+    }
+
+    logger.flush();
+
+    char buffer[LOGGER_MESSAGE_SIZE];
+    LoggerThread::write_all(buffer, LoggerThread::format_message(buffer, level, format, args));
+}
+
+void flush() {
+    logger.flush();
+}
+
+}
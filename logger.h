@@ -2,24 +2,70 @@
 
 #include <fmt/format.h>
 
+#include <atomic>
+
+#define LOGGER_LEVEL_DEBUG 0
+#define LOGGER_LEVEL_WARNING 1
+#define LOGGER_LEVEL_ERROR 2
+
+// Messages below this level are compiled out
+#ifndef LOGGER_MIN_LEVEL
+#define LOGGER_MIN_LEVEL LOGGER_LEVEL_DEBUG
+#endif
+
 namespace Logger {
-    
+
+enum class Level {
+    Debug = LOGGER_LEVEL_DEBUG,
+    Warning = LOGGER_LEVEL_WARNING,
+    Error = LOGGER_LEVEL_ERROR,
+};
+
+// Messages below this level are dropped at runtime
+inline std::atomic<Level> runtimeLevel = Level::Debug;
+
+inline void set_level(Level level) {
+    runtimeLevel.store(level, std::memory_order_relaxed);
+}
+
+inline bool is_enabled(Level level) {
+    return (int)level >= LOGGER_MIN_LEVEL && level >= runtimeLevel.load(std::memory_order_relaxed);
+}
+
+// Debug and warning messages are queued and written by the logger thread,
+// so logging never blocks the caller. Errors first wait for anything queued
+// then are written straight away, as they often come right before exiting
+void log(Level level, fmt::string_view format, fmt::format_args args);
+
+// Waits for every queued message to be written
+void flush();
+
+// Below LOGGER_MIN_LEVEL nothing is formatted or queued, but the arguments
+// are still evaluated by the caller, so avoid anything expensive or with
+// side effects in debug messages on hot paths
+
 template <typename... Args> inline void Debug(fmt::format_string<Args...> f, Args&&... args) {
-    fmt::print(stderr, "[{}] [Debug] ", "terminal_apple");
-    fmt::vprint(stderr, f, fmt::make_format_args(args...));
-    fmt::print(stderr, "\n");
+    if constexpr(LOGGER_MIN_LEVEL <= LOGGER_LEVEL_DEBUG) {
+        if(is_enabled(Level::Debug)) {
+            log(Level::Debug, f, fmt::make_format_args(args...));
+        }
+    }
 }
 
 template <typename... Args> inline void Warning(fmt::format_string<Args...> f, Args&&... args) {
-    fmt::print(stderr, "[{}] [Warning] ", "terminal_apple");
-    fmt::vprint(stderr, f, fmt::make_format_args(args...));
-    fmt::print(stderr, "\n");
+    if constexpr(LOGGER_MIN_LEVEL <= LOGGER_LEVEL_WARNING) {
+        if(is_enabled(Level::Warning)) {
+            log(Level::Warning, f, fmt::make_format_args(args...));
+        }
+    }
 }
 
 template <typename... Args> inline void Error(fmt::format_string<Args...> f, Args&&... args) {
-    fmt::print(stderr, "[{}] [Error] ", "terminal_apple");
-    fmt::vprint(stderr, f, fmt::make_format_args(args...));
-    fmt::print(stderr, "\n");
+    if constexpr(LOGGER_MIN_LEVEL <= LOGGER_LEVEL_ERROR) {
+        if(is_enabled(Level::Error)) {
+            log(Level::Error, f, fmt::make_format_args(args...));
+        }
+    }
 }
 
-}
\ No newline at end of file
+}
@@ -8,13 +8,18 @@
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
 #include <vector>
 
 #include "frame.h"
+#include "frame_cache.h"
+#include "frame_pack.h"
 #include "image.h"
 #include "logger.h"
 #include "output.h"
 #include "paths.h"
+#include "recording.h"
+#include "stats.h"
 #include "stream_context.h"
 
 void load_image_data(const char* str, std::vector<uint8_t>& data, int sWidth, int sHeight) {
@@ -98,16 +103,51 @@ void load_image_data(const char* str, std::vector<uint8_t>& data, int sWidth, in
 }
 
 void print_usage() {
-    printf("Usage: ttyapple <video|frames> <file>");
+    printf("Usage: ttyapple [options] <video|frames|pack|replay> <file>\n"
+           "\n"
+           "Options:\n"
+           "  -w, --width <columns>       Output width\n"
+           "  -h, --height <rows>         Output height\n"
+           "  -o, --output <format>       tty, c, uefi, server or pack\n"
+           "  -j, --jobs <count>          Threads for the c, uefi and pack outputs. When decoding\n"
+           "                              a video, half go to decoding (at least 2 once count is\n"
+           "                              2 or more) and the rest to encoding frames, which\n"
+           "                              with uefi also sets how many clang processes compile them\n"
+           "  -b, --blob <mode>           Store frames with incbin, embed or object\n"
+           "  -d, --delta                 Delta encode frames\n"
+           "  -c, --compress <method>     Compress frames with rle or lz\n"
+           "  -i, --interlace             Interlace frames\n"
+           "  -f, --framebuffer           Draw to the UEFI framebuffer\n"
+           "  -p, --port <port>           Port for the server output\n"
+           "  -r, --record <file>         Record terminal output\n"
+           "  -l, --loop                  Loop frame packs\n"
+           "  -s, --start <seconds>       Start frame packs part way through\n"
+           "  -C, --cache                 Cache decoded videos\n"
+           "  -S, --stats                 Print the time spent in each stage\n"
+           "  -T, --stats-file <file>     Also write the stats as JSON\n"
+           "  -R, --trace <file>          Write a Chrome trace\n"
+           "  -L, --log-level <level>     debug, warning or error\n"
+           "      --help                  Show this message\n");
 }
 
 Output* output;
+// Decoded frames are also written here when caching
+PackedOutput* frameCache = nullptr;
 
-void video_decoder_push_frame(Frame* frame) {
-    output->send_frame(frame);
+void video_decoder_push_frame(FrameHandle frame) {
+    if(frameCache) {
+        FrameHandle cached = frameCache->acquire_frame();
+        memcpy(cached->data, frame->data, frameCache->width() * frameCache->height());
+        cached->usTimestamp = frame->usTimestamp;
+
+        frameCache->send_frame(std::move(cached));
+        frameCache->run();
+    }
+
+    output->send_frame(std::move(frame));
 }
 
-Frame* video_decoder_acquire_frame() {
+FrameHandle video_decoder_acquire_frame() {
     return output->acquire_frame();
 }
 
@@ -116,6 +156,8 @@ enum class OutputFormat {
     Terminal,
     PortableC,
     UEFI,
+    Server,
+    Pack,
 };
 
 OutputFormat get_format_for_string(const char* s) {
@@ -125,6 +167,10 @@ OutputFormat get_format_for_string(const char* s) {
         return OutputFormat::PortableC;
     } else if(!strcmp(s, "uefi")) {
         return OutputFormat::UEFI;
+    } else if(!strcmp(s, "server")) {
+        return OutputFormat::Server;
+    } else if(!strcmp(s, "pack")) {
+        return OutputFormat::Pack;
     }
 
     return OutputFormat::Invalid;
@@ -138,6 +184,10 @@ Output* make_output(OutputFormat fmt, int width, int height) {
         return new COutput(width, height);
     case OutputFormat::UEFI:
         return new UEFIOutput(width, height);
+    case OutputFormat::Server:
+        return new ServerOutput(width, height);
+    case OutputFormat::Pack:
+        return new PackedOutput(width, height);
     default:
         Logger::Error("Invalid output format {}!", (int)fmt);
         return nullptr;
@@ -149,16 +199,55 @@ int main(int argc, char** argv) {
         {"width", required_argument, nullptr, 'w'},
         {"height", required_argument, nullptr, 'h'}, 
         {"output", required_argument, nullptr, 'o'},
+        {"jobs", required_argument, nullptr, 'j'},
+        {"blob", required_argument, nullptr, 'b'},
+        {"delta", no_argument, nullptr, 'd'},
+        {"compress", required_argument, nullptr, 'c'},
+        {"interlace", no_argument, nullptr, 'i'},
+        {"framebuffer", no_argument, nullptr, 'f'},
+        {"port", required_argument, nullptr, 'p'},
+        {"record", required_argument, nullptr, 'r'},
+        {"loop", no_argument, nullptr, 'l'},
+        {"start", required_argument, nullptr, 's'},
+        {"cache", no_argument, nullptr, 'C'},
+        {"stats", no_argument, nullptr, 'S'},
+        {"stats-file", required_argument, nullptr, 'T'},
+        {"trace", required_argument, nullptr, 'R'},
+        {"log-level", required_argument, nullptr, 'L'},
+        {"help", no_argument, nullptr, 'H'},
         {nullptr, 0, nullptr, 0}
     };
     
     int width = 96;
     int height = 72;
+    // Number of threads shared between decoding and encoding,
+    // only applies to offline outputs
+    int jobs = 1;
+
+    FrameStorage frameStorage = FrameStorage::Array;
+    bool deltaFrames = false;
+    bool interlace = false;
+    bool framebuffer = false;
+    // Port to accept viewers on with the server output
+    int port = 2323;
+    // File to record terminal output to
+    const char* recordPath = nullptr;
+    // Frame pack playback
+    bool loop = false;
+    float startTime = 0;
+    // Keep decoded frames around for the next time the video is played
+    bool cacheFrames = false;
+    // Time each stage of playback, the stats are also written to statsPath if set
+    bool collectStats = false;
+    const char* statsPath = nullptr;
+    // Chrome trace of every stage of every frame
+    const char* tracePath = nullptr;
+    FrameCompression compression = FrameCompression::None;
 
     OutputFormat outputFormat = OutputFormat::Terminal;
 
     char opt;
-    while((opt = getopt_long(argc, argv, "w:h:", opts, nullptr)) != -1) {
+    while((opt = getopt_long(argc, argv, "w:h:j:", opts, nullptr)) != -1) {
         if(opt == 'w') {
             width = std::stoi(optarg);
         } else if(opt == 'h') {
@@ -166,7 +255,66 @@ int main(int argc, char** argv) {
         } else if(opt == 'o') {
             outputFormat = get_format_for_string(optarg);
             if(outputFormat == OutputFormat::Invalid) {
-                printf("Invalid output '%s'! Valid options are: tty, c, uefi", optarg);
+                printf("Invalid output '%s'! Valid options are: tty, c, uefi, server, pack", optarg);
+                return 1;
+            }
+        } else if(opt == 'j') {
+            jobs = std::stoi(optarg);
+        } else if(opt == 'b') {
+            if(!strcmp(optarg, "incbin")) {
+                frameStorage = FrameStorage::Incbin;
+            } else if(!strcmp(optarg, "embed")) {
+                frameStorage = FrameStorage::Embed;
+            } else if(!strcmp(optarg, "object")) {
+                frameStorage = FrameStorage::Object;
+            } else {
+                printf("Invalid blob mode '%s'! Valid options are: incbin, embed, object", optarg);
+                return 1;
+            }
+        } else if(opt == 'd') {
+            deltaFrames = true;
+        } else if(opt == 'i') {
+            interlace = true;
+        } else if(opt == 'f') {
+            framebuffer = true;
+        } else if(opt == 'p') {
+            port = std::stoi(optarg);
+        } else if(opt == 'r') {
+            recordPath = optarg;
+        } else if(opt == 'l') {
+            loop = true;
+        } else if(opt == 's') {
+            startTime = std::stof(optarg);
+        } else if(opt == 'C') {
+            cacheFrames = true;
+        } else if(opt == 'S') {
+            collectStats = true;
+        } else if(opt == 'T') {
+            collectStats = true;
+            statsPath = optarg;
+        } else if(opt == 'R') {
+            tracePath = optarg;
+        } else if(opt == 'L') {
+            if(!strcmp(optarg, "debug")) {
+                Logger::set_level(Logger::Level::Debug);
+            } else if(!strcmp(optarg, "warning")) {
+                Logger::set_level(Logger::Level::Warning);
+            } else if(!strcmp(optarg, "error")) {
+                Logger::set_level(Logger::Level::Error);
+            } else {
+                printf("Invalid log level '%s'! Valid options are: debug, warning, error", optarg);
+                return 1;
+            }
+        } else if(opt == 'H') {
+            print_usage();
+            return 0;
+        } else if(opt == 'c') {
+            if(!strcmp(optarg, "rle")) {
+                compression = FrameCompression::RLE;
+            } else if(!strcmp(optarg, "lz")) {
+                compression = FrameCompression::LZ;
+            } else {
+                printf("Invalid compression '%s'! Valid options are: rle, lz", optarg);
                 return 1;
             }
         }
@@ -181,9 +329,81 @@ int main(int argc, char** argv) {
 
     assert(width > 0 && height > 0);
 
+    if(jobs < 1) {
+        printf("Invalid number of jobs %d!", jobs);
+        return 1;
+    }
+
+    // Before any threads are started
+    if(collectStats) {
+        stats_enable(statsPath);
+    }
+
+    if(tracePath) {
+        trace_enable(tracePath);
+    }
+
     const char* source = argv[optind];
     const char* sourceFile = argv[optind + 1];
 
+    // Recordings are played as is, nothing needs decoding
+    if(!strcmp(source, "replay")) {
+        return replay_recording(sourceFile) ? 2 : 0;
+    }
+
+    // Outputs which generate a program rather than playing in real time
+    bool offlineOutput = outputFormat == OutputFormat::PortableC || outputFormat == OutputFormat::UEFI
+        || outputFormat == OutputFormat::Pack;
+
+    if(jobs > 1 && !offlineOutput) {
+        Logger::Warning("Parallel decoding is not supported when playing in real time, ignoring --jobs");
+        jobs = 1;
+    }
+
+    // Play straight from the cache if this video has been decoded before
+    std::string cachePath;
+    // Cache being played, sourceFile points into it
+    std::string cachedPackPath;
+    if(cacheFrames) {
+        if(strcmp(source, "video")) {
+            Logger::Warning("--cache only applies to videos, ignoring");
+        } else {
+            cachePath = frame_cache_path(sourceFile, width, height);
+        }
+
+        if(!cachePath.empty() && access(cachePath.c_str(), R_OK) == 0) {
+            // Cached frames could have been cut short or damaged since,
+            // make sure they all decode before playing them
+            FramePack cached;
+            if(cached.open(cachePath.c_str()) || cached.verify()) {
+                Logger::Warning("Cached frames {} are corrupt, decoding the video again", cachePath);
+                unlink(cachePath.c_str());
+            } else {
+                Logger::Debug("Using cached frames {}", cachePath);
+
+                // Nothing needs writing to the cache
+                cachedPackPath = std::move(cachePath);
+                cachePath.clear();
+
+                source = "pack";
+                sourceFile = cachedPackPath.c_str();
+            }
+        }
+    }
+
+    // Frame packs are played at the size they were made
+    FramePack pack;
+    if(!strcmp(source, "pack")) {
+        if(pack.open(sourceFile)) {
+            return 2;
+        }
+
+        width = pack.width();
+        height = pack.height();
+    } else if(loop || startTime) {
+        Logger::Warning("--loop and --start only apply to frame packs, ignoring");
+    }
+
     output = make_output(outputFormat, width, height);
     assert(output);
 
@@ -193,19 +413,128 @@ int main(int argc, char** argv) {
         }
     }
 
+    if(outputFormat == OutputFormat::Pack) {
+        if(((PackedOutput*)output)->open_pack("output.pack")) {
+            return 2;
+        }
+    }
+
+    // Written under another name and renamed into place once the whole
+    // video has been decoded, so partial caches are never used
+    std::string partialCachePath;
+    if(!cachePath.empty()) {
+        partialCachePath = fmt::format("{}.{}.tmp", cachePath, getpid());
+
+        frameCache = new PackedOutput(width, height);
+        frameCache->set_delta_encoding(true);
+        frameCache->set_compression(FrameCompression::LZ);
+        if(frameCache->open_pack(partialCachePath.c_str())) {
+            delete frameCache;
+            frameCache = nullptr;
+        }
+    }
+
+    if(outputFormat == OutputFormat::Server) {
+        if(((ServerOutput*)output)->listen(port)) {
+            return 2;
+        }
+    }
+
+    if(recordPath) {
+        if(outputFormat != OutputFormat::Terminal) {
+            Logger::Warning("--record only applies to the tty output, ignoring");
+        } else if(((TTYOutput*)output)->set_recording(recordPath, recording_format_for_path(recordPath))) {
+            return 2;
+        }
+    }
+
+    if(interlace) {
+        if(!offlineOutput) {
+            Logger::Warning("--interlace only applies to the c, uefi and pack outputs, ignoring");
+        } else if(height % 4) {
+            printf("Height must be a multiple of 4 when interlacing!");
+            return 1;
+        } else {
+            output->set_interlacing(true);
+        }
+    }
+
+    if(deltaFrames) {
+        if(!offlineOutput) {
+            Logger::Warning("--delta only applies to the c, uefi and pack outputs, ignoring");
+        } else {
+            ((COutput*)output)->set_delta_encoding(true);
+        }
+    }
+
+    if(compression != FrameCompression::None) {
+        if(!offlineOutput) {
+            Logger::Warning("--compress only applies to the c, uefi and pack outputs, ignoring");
+        } else {
+            ((COutput*)output)->set_compression(compression);
+        }
+    }
+
+    if(frameStorage != FrameStorage::Array) {
+        const char* blobPath = outputFormat == OutputFormat::UEFI ? "frames.bin" : "output.bin";
+        if(frameStorage == FrameStorage::Object) {
+            blobPath = "frames.obj";
+        }
+
+        if(!offlineOutput || outputFormat == OutputFormat::Pack) {
+            Logger::Warning("--blob only applies to the c and uefi outputs, ignoring");
+        } else if(frameStorage == FrameStorage::Object && outputFormat != OutputFormat::UEFI) {
+            printf("--blob object is only supported by the uefi output!");
+            return 1;
+        } else if(((COutput*)output)->set_frame_storage(frameStorage, blobPath)) {
+            return 2;
+        }
+    }
+
+    if(framebuffer) {
+        if(outputFormat != OutputFormat::UEFI) {
+            Logger::Warning("--framebuffer only applies to the uefi output, ignoring");
+        } else {
+            ((UEFIOutput*)output)->set_framebuffer(true);
+        }
+    }
+
+    // Decoding a video and encoding its frames happen at the same time,
+    // so split the threads between them rather than starting jobs of each.
+    // Decoding always gets at least 2 so it is still done in parallel
+    int decodeJobs = 1;
+    int encodeJobs = jobs;
+    if(!strcmp(source, "video") && jobs >= 2) {
+        decodeJobs = std::max(2, jobs / 2);
+        encodeJobs = std::max(1, jobs - decodeJobs);
+    }
+
+    if(offlineOutput) {
+        ((COutput*)output)->set_worker_count(encodeJobs);
+    }
+
+    // Frame arrays are compiled as they are written, as part of encoding
+    if(outputFormat == OutputFormat::UEFI) {
+        ((UEFIOutput*)output)->set_shard_count(encodeJobs);
+    }
+
     if(!strcmp(source, "frames")) {
         for(unsigned i = 1; i <= 7777; i++) {
             char filepath[PATH_MAX];
             snprintf(filepath, PATH_MAX, "%s/frame%03d.png", sourceFile, i);
 
             std::vector<uint8_t> frameData;
+            StageTimer decodeTimer{Stage::Decode};
             load_image_data(filepath, frameData, width, height);
+            decodeTimer.stop();
+            stats_add(Counter::FramesDecoded);
 
-            Frame* frame = output->acquire_frame();
+            // Copied into the frame's own buffer, which stays with the output
+            FrameHandle frame = output->acquire_frame();
+            memcpy(frame->data, frameData.data(), frameData.size());
             frame->usTimestamp = 1000000 / 24 * i;
-            frame->data = frameData.data();
 
-            output->send_frame(frame);
+            output->send_frame(std::move(frame));
             output->run();
         }
 
@@ -217,6 +546,7 @@ int main(int argc, char** argv) {
         decoder.push_buffer = video_decoder_push_frame;
 
         decoder.set_output_format(width,height);
+        decoder.set_segment_count(decodeJobs);
         decoder.play_track(sourceFile);
 
         while(decoder.is_playing()) {
@@ -225,6 +555,47 @@ int main(int argc, char** argv) {
 
         output->finish();
         delete output;
+
+        if(frameCache) {
+            frameCache->finish();
+            delete frameCache;
+
+            if(!decoder.reached_end_of_file()) {
+                unlink(partialCachePath.c_str());
+            } else if(rename(partialCachePath.c_str(), cachePath.c_str())) {
+                Logger::Warning("Failed to rename '{}' to '{}': {}", partialCachePath, cachePath, strerror(errno));
+                unlink(partialCachePath.c_str());
+            }
+        }
+    } else if(!strcmp(source, "pack")) {
+        int index = pack.frame_at(startTime * 1000000);
+        // Looped frames carry on from the end rather than going back in time
+        long loopOffset = 0;
+
+        while(index < pack.frame_count()) {
+            FrameHandle frame = output->acquire_frame();
+            StageTimer decodeTimer{Stage::Decode};
+            if(pack.decode_frame(index, frame->data)) {
+                frame.reset();
+                output->finish();
+                delete output;
+                return 2;
+            }
+            decodeTimer.stop();
+            stats_add(Counter::FramesDecoded);
+            frame->usTimestamp = loopOffset + pack.frame_timestamp(index);
+
+            output->send_frame(std::move(frame));
+            output->run();
+
+            if(++index == pack.frame_count() && loop) {
+                index = 0;
+                loopOffset += pack.duration();
+            }
+        }
+
+        output->finish();
+        delete output;
     } else {
         print_usage();
         return 1;
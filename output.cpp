@@ -1,41 +1,41 @@
 #include "output.h"
 
 #include "frame.h"
+#include "stats.h"
 
 #include <cassert>
 
 Output::Output(int width, int height)
-    : m_width(width), m_height(height) {
-    m_currentFrame = new Frame;
-    m_lastFrame = new Frame;
-    m_nextFrame = nullptr;
-
-    m_currentFrame->data = allocate_frame_buffer<uint8_t>(width, height);
-    m_lastFrame->data = allocate_frame_buffer<uint8_t>(width, height);
+    : m_width(width), m_height(height), m_framePool(width, height, OUTPUT_FRAME_COUNT) {
+    m_currentFrame = m_framePool.acquire();
+    m_lastFrame = m_framePool.acquire();
 }
 
-void Output::send_frame(Frame* frame) {
+void Output::send_frame(FrameHandle frame) {
+    StageTimer timer{Stage::SendWait};
     std::unique_lock lock{m_frameLock};
     m_frameCondition.wait(lock, [this]{return !m_nextFrame;});
+    timer.stop();
 
     assert(!m_nextFrame);
-    m_nextFrame = frame;
+    m_nextFrame = std::move(frame);
 
     lock.unlock();
     m_frameCondition.notify_all();
 }
 
-Frame* Output::acquire_frame() {
-    Frame* frame;
+FrameHandle Output::acquire_frame() {
+    FrameHandle frame;
 
     // Reuse the last processed frame
 
+    StageTimer timer{Stage::AcquireWait};
     std::unique_lock lock{m_frameLock};
-    m_frameCondition.wait(lock, [this]{return m_lastFrame;});
+    m_frameCondition.wait(lock, [this]{return m_lastFrame != nullptr;});
+    timer.stop();
 
     assert(m_lastFrame);
-    frame = m_lastFrame;
-    m_lastFrame = nullptr;
+    frame = std::move(m_lastFrame);
 
     lock.unlock();
     m_frameCondition.notify_all();
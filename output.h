@@ -1,24 +1,48 @@
 #pragma once
 
+#include "c_writer.h"
+#include "coff_writer.h"
+#include "frame.h"
+#include "frame_encoding.h"
+#include "frame_pack.h"
+#include "recording.h"
+
+#include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
-struct Frame;
+// Frames passed between the decoder and an output,
+// one is drawn while the other is filled in
+#define OUTPUT_FRAME_COUNT 2
 
 class Output {
 public:
     Output(int width, int height);
+    virtual ~Output() = default;
 
     // Any data accessed by these two functions should be protected by a lock
     // as they may be called from another thread.
-    virtual void send_frame(Frame* frame);
-    virtual Frame* acquire_frame();
+    // Frames from acquire_frame are given back with send_frame once filled in
+    virtual void send_frame(FrameHandle frame);
+    virtual FrameHandle acquire_frame();
 
+    // Only send every other line of text each frame, alternating between
+    // the even and odd lines. Height must be a multiple of 4
     void set_interlacing(bool enabled);
 
     virtual void run() = 0;
     virtual void finish();
 
+    inline int width() const { return m_width; }
+    inline int height() const { return m_height; }
+
 protected:
     int m_width;
     int m_height;
@@ -26,31 +50,130 @@ protected:
     std::mutex m_frameLock;
     std::condition_variable m_frameCondition;
 
+    // Declared before the frames so it outlives them
+    FramePool m_framePool;
+
     // Current frame being processed
-    Frame* m_currentFrame;
+    FrameHandle m_currentFrame;
     // Last frame to be processed
-    Frame* m_lastFrame;
+    FrameHandle m_lastFrame;
     // Frame waiting to be processed
-    Frame* m_nextFrame;
+    FrameHandle m_nextFrame;
 
     long m_lastFrameTimestamp = -1;
 
     bool m_interlaced = false;
 };
 
+// Renders two rows of pixels as a null terminated line of half block characters
+void frame_data_to_string(uint8_t* top, uint8_t* bottom, unsigned width, std::vector<char>& outString);
+// Clears the terminal and prints each line from frame_data_to_string to out,
+// returns the number of bytes written
+size_t print_frame_data(FILE* out, std::vector<std::vector<char>>& rows);
+
 class TTYOutput : public Output {
 public:
     TTYOutput(int width, int height);
-    ~TTYOutput();
+
+    // Records everything written to the terminal to path,
+    // returns 0 on success
+    int set_recording(const char* path, RecordingFormat format);
+    // Writes frames to out instead of stdout
+    void set_file(FILE* out);
+    // Waits until each frame is due before drawing it, on by default.
+    // Otherwise frames are drawn as soon as they are decoded
+    void set_pacing(bool enabled);
 
     void run() override;
 
 private:
     FILE* m_out;
+    bool m_pacing = true;
+
+    std::unique_ptr<Recorder> m_recorder;
+    // Bytes written for the current frame, kept to avoid reallocating
+    std::string m_recordBuffer;
+    // Text of each row, kept for the same reason
+    std::vector<std::vector<char>> m_rows;
 
     std::chrono::time_point<std::chrono::steady_clock> m_lastFrameDrawn;
 };
 
+// Plays to every viewer connected over TCP (e.g. with telnet).
+// Each frame is rendered once and the same bytes are sent to every viewer,
+// viewers that can't keep up skip frames rather than falling behind
+class ServerOutput : public Output {
+public:
+    ServerOutput(int width, int height);
+    ~ServerOutput();
+
+    // Starts accepting viewers on port, returns 0 on success
+    int listen(int port);
+
+    void run() override;
+    void finish() override;
+
+private:
+    struct Client {
+        int fd;
+        // Frame being sent and how much of it has been sent so far
+        std::shared_ptr<const std::string> frame;
+        size_t offset = 0;
+        uint64_t sequence = 0;
+        // Whether we are waiting on EPOLLOUT
+        bool blocked = false;
+    };
+
+    void network_thread();
+    void accept_clients();
+    // Sends as much as the socket will take, moving on to the newest frame
+    // once the current one is done. Returns false if the client has gone
+    bool send_to_client(Client& client);
+    void close_client(Client& client);
+
+    // Newest frame and its sequence number, nullptr if there isn't one yet
+    std::shared_ptr<const std::string> newest_frame(uint64_t& sequence);
+
+    int m_listenSocket = -1;
+    int m_epoll = -1;
+    // Signalled when there is a new frame or the network thread should stop
+    int m_wakeEvent = -1;
+    std::thread m_networkThread;
+
+    // Protects the newest frame and m_stop
+    std::mutex m_newestFrameLock;
+    // Only the newest frame is kept, viewers still sending
+    // an older one hold on to it themselves
+    std::shared_ptr<const std::string> m_newestFrame;
+    // Sequence number of the newest frame, starting from 1
+    uint64_t m_newestSequence = 0;
+    bool m_stop = false;
+
+    // Only used by the network thread
+    std::unordered_map<int, Client> m_clients;
+
+    // Frames are shown relative to when the first one was
+    std::chrono::time_point<std::chrono::steady_clock> m_startTime;
+    long m_firstFrameTimestamp = -1;
+};
+
+// How COutput stores the frame data in the generated source
+enum class FrameStorage {
+    // A uint8_t array literal for each frame
+    Array,
+    // Frame data is written to a binary file which is pulled
+    // into the program with the .incbin assembler directive
+    Incbin,
+    // Same as Incbin but using the C23 #embed directive
+    Embed,
+    // Frame data and tables are written straight to a COFF object
+    // at blobPath with no generated source, only supported by UEFIOutput
+    Object,
+    // Frame data goes into a frame pack (see frame_pack.h),
+    // only used by PackedOutput
+    Pack,
+};
+
 class COutput : public Output {
 public:
     COutput(int width, int height);
@@ -59,14 +182,174 @@ public:
     int open_file(const char* path);
     void close_file();
 
+    // Must be called before the first frame,
+    // blobPath is ignored when using FrameStorage::Array
+    int set_frame_storage(FrameStorage storage, const char* blobPath);
+    // Store each frame as the difference from the previous one,
+    // must be called before the first frame
+    void set_delta_encoding(bool enabled);
+    // Compress each frame, must be called before the first frame
+    void set_compression(FrameCompression compression);
+    // Pack and encode frames on count threads whilst another thread writes
+    // them out in order, must be called before the first frame
+    void set_worker_count(int count);
+
     void run() override;
     virtual void finish() override;
 
 protected:
     FILE* m_out = nullptr;
+    CWriter m_writer;
 
     uint8_t* m_packedPixelBuffer;
+    // Packed pixels of the last frame of each field, used for delta encoding.
+    // Only the first is used when not interlacing
+    uint8_t* m_previousPackedBuffers[2];
+    std::vector<uint8_t> m_encodedBuffer;
+    // XOR of the previous and current frame when compressing delta frames
+    std::vector<uint8_t> m_deltaBuffer;
     int m_frameIndex = 0;
+
+    bool m_deltaEncoding = false;
+    FrameCompression m_compression = FrameCompression::None;
+
+    FrameStorage m_storage = FrameStorage::Array;
+    std::string m_blobPath;
+    FILE* m_blob = nullptr;
+    size_t m_blobSize = 0;
+    // Used instead of m_blob with FrameStorage::Object
+    CoffWriter m_object;
+    // Offset of each frame in the object
+    std::vector<uint32_t> m_frameOffsets;
+
+    // Expression for the data of each frame in the frames table
+    std::vector<std::string> m_frameNames;
+
+    struct UniqueFrame {
+        // Index of the first frame with this data
+        size_t index;
+        // Where the data is in m_uniqueData
+        uint64_t offset;
+        unsigned size;
+    };
+
+    // Unique frames by the hash of their encoded data
+    std::unordered_multimap<uint64_t, UniqueFrame> m_uniqueFrames;
+    // Data of each unique frame, kept on disk rather than in memory
+    // to check frames with the same hash against
+    FILE* m_uniqueData = nullptr;
+    uint64_t m_uniqueDataSize = 0;
+
+    // Timestamp of each frame in microseconds
+    std::vector<long> m_frameTimestamps;
+    // Average frame interval in microseconds and whether every frame
+    // is shown for about that long, set by finish
+    long m_frameInterval = 1000000 / 24;
+    bool m_constantRate = true;
+
+    // When set the decoder is compiled on its own, so FRAME_COUNT
+    // and FRAME_INTERVAL are also written out as variables
+    bool m_separateDecoder = false;
+
+    // How many frames of each field apart delta frames are encoded against
+    // a blank frame instead of the previous one, so playback can start there.
+    // 0 if only the first frames are
+    int m_keyframeInterval = 0;
+
+    // Macros the decoder is configured with as name and value pairs,
+    // leaving out FRAME_COUNT and FRAME_INTERVAL
+    std::vector<std::pair<std::string, std::string>> decoder_defines() const;
+
+    // Whether frame index is delta encoded against a blank frame
+    bool is_keyframe(int index) const;
+    // Returns the index of an earlier frame with the same encoded data,
+    // otherwise remembers the data as frame index and returns -1
+    long find_duplicate_frame(const uint8_t* data, unsigned size, size_t index);
+    // Sets m_frameInterval and m_constantRate from the frame timestamps
+    void measure_frame_rate();
+
+    // Writes an encoded frame, frames must be written in order.
+    // text is the already generated array if there is one
+    virtual void write_frame(int index, const uint8_t* data, unsigned size, const std::string* text = nullptr);
+    // Waits for all submitted frames to be written
+    void stop_workers();
+
+    // Where the array for frame index gets written with FrameStorage::Array,
+    // frames written anywhere other than m_writer are declared extern
+    virtual CWriter& frame_writer(int index);
+    std::vector<std::string> m_externFrames;
+
+private:
+    struct EncodeJob {
+        int index;
+        std::shared_ptr<std::vector<uint8_t>> pixels;
+        // Only set when using delta frames
+        std::shared_ptr<std::vector<uint8_t>> previousPixels;
+    };
+
+    struct EncodedFrame {
+        std::vector<uint8_t> data;
+        // Generated array when using FrameStorage::Array
+        std::string text;
+    };
+
+    // Which of the previous frame buffers frame index is delta encoded against
+    int delta_reference(int index) const;
+    // Packs the pixels of frame index, returns the packed size
+    unsigned pack_frame(const uint8_t* pixels, int index, uint8_t* packed) const;
+    void encode_packed(const uint8_t* packed, const uint8_t* previousPacked, unsigned size,
+                       std::vector<uint8_t>& out, std::vector<uint8_t>& deltaBuffer) const;
+    void write_blob_include();
+    // How long each frame is shown for in milliseconds, for variable frame rate videos
+    std::vector<uint16_t> frame_durations() const;
+    void write_frame_durations();
+    // Writes the frames table and everything the decoder needs to m_object
+    void write_object();
+
+    void submit_frame(const uint8_t* pixels);
+    void encode_worker();
+    void write_worker();
+
+    std::vector<std::thread> m_workers;
+    std::thread m_writerThread;
+
+    // Protects everything used by the workers below
+    std::mutex m_jobLock;
+    std::condition_variable m_jobCondition;
+
+    std::deque<EncodeJob> m_jobs;
+    // Frames which have been encoded but not yet written, by index
+    std::map<int, EncodedFrame> m_encodedFrames;
+    int m_jobsSubmitted = 0;
+    int m_jobsWritten = 0;
+    bool m_stopWorkers = false;
+
+    std::shared_ptr<std::vector<uint8_t>> m_lastSubmittedPixels[2];
+};
+
+// Frames of each field between keyframes in frame packs
+#define PACK_KEYFRAME_INTERVAL 48
+
+// Writes the encoded frames to a frame pack rather than generating a program
+class PackedOutput : public COutput {
+public:
+    PackedOutput(int width, int height);
+    ~PackedOutput();
+
+    int open_pack(const char* path);
+
+    void finish() override;
+
+protected:
+    void write_frame(int index, const uint8_t* data, unsigned size, const std::string* text) override;
+
+private:
+    FILE* m_pack = nullptr;
+    std::string m_packPath;
+    uint64_t m_packSize = sizeof(FramePackHeader);
+
+    // Timestamps are filled in by finish
+    std::vector<FramePackEntry> m_entries;
 };
 
 class UEFIOutput : public COutput {
@@ -74,18 +357,48 @@ public:
     UEFIOutput(int width, int height);
 
     void set_output_file(const char* path);
+    // Draw frames to the Graphics Output Protocol framebuffer instead of
+    // as text on the console, must be called before the first frame
+    void set_framebuffer(bool enabled);
+    // Split the frame arrays between count clang processes,
+    // must be called before the first frame
+    void set_shard_count(int count);
 
     void finish() override;
 private:
+    // Frame arrays are split across several translation units,
+    // each compiled by its own clang process as it is written
+    struct FrameShard {
+        FILE* out;
+        CWriter writer;
+        pid_t compilerPID;
+        std::string object;
+    };
+
+    CWriter& frame_writer(int index) override;
+
+    // Starts clang compiling the C source written to the returned file into object
+    FILE* start_compiler(const std::string& object, pid_t& pid);
+
+    // Compiles source with flags into the build cache unless an object
+    // built from the same source and flags is already there.
+    // Returns the path of the object
+    std::string cached_object(const std::string& source, const std::vector<std::string>& flags);
+
     std::string m_outputPath;
 
     std::string m_compiler;
     std::string m_linker;
 
-    FILE* m_decodeSource;
-    FILE* m_uefiMainSource;
-
-    int m_pipe[2];
+    std::string m_dataDir;
+    // Flags shared by every object in the image
+    std::vector<std::string> m_compileFlags;
 
+    // Compiles everything other than the frame arrays,
+    // not used with FrameStorage::Object
     pid_t m_compilerPID;
+
+    // One clang process per shard
+    unsigned m_shardCount = 1;
+    std::vector<std::unique_ptr<FrameShard>> m_shards;
 };
@@ -0,0 +1,109 @@
+#include "output.h"
+
+#include "frame_pack.h"
+#include "logger.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+PackedOutput::PackedOutput(int width, int height)
+    : COutput(width, height) {
+    m_storage = FrameStorage::Pack;
+    // Lets playback start anywhere without going through every delta frame
+    m_keyframeInterval = PACK_KEYFRAME_INTERVAL;
+}
+
+PackedOutput::~PackedOutput() {
+    // Make sure the workers are done with the file
+    stop_workers();
+
+    if(m_pack) {
+        fclose(m_pack);
+    }
+}
+
+int PackedOutput::open_pack(const char* path) {
+    m_packPath = path;
+    m_pack = fopen(path, "wb");
+    if(!m_pack) {
+        Logger::Error("Failed to open '{}' for writing!", path);
+        return 1;
+    }
+
+    // The header is written once everything else is known
+    if(fseek(m_pack, sizeof(FramePackHeader), SEEK_SET)) {
+        Logger::Error("Error writing '{}': {}", m_packPath, strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
+
+void PackedOutput::write_frame(int, const uint8_t* data, unsigned size, const std::string*) {
+    // Identical frames are only stored once
+    long duplicate = find_duplicate_frame(data, size, m_entries.size());
+    if(duplicate >= 0) {
+        m_entries.push_back(m_entries[duplicate]);
+        return;
+    }
+
+    assert(m_pack);
+    if(fwrite(data, 1, size, m_pack) != size) {
+        Logger::Error("Error writing '{}': {}", m_packPath, strerror(errno));
+        std::terminate();
+    }
+
+    FramePackEntry entry = {};
+    entry.offset = m_packSize;
+    entry.size = size;
+    m_entries.push_back(entry);
+
+    m_packSize += size;
+}
+
+void PackedOutput::finish() {
+    assert(m_pack);
+
+    // Wait for every frame to be written out
+    stop_workers();
+
+    Logger::Debug("{} frames, {} unique", m_frameIndex, m_uniqueFrames.size());
+
+    measure_frame_rate();
+
+    assert(m_entries.size() == m_frameTimestamps.size());
+    for(size_t i = 0; i < m_entries.size(); i++) {
+        FramePackEntry& entry = m_entries[i];
+        entry.offset = le64(entry.offset);
+        entry.usTimestamp = le64(m_frameTimestamps[i] - m_frameTimestamps.front());
+        entry.size = le32(entry.size);
+    }
+
+    // Keep the index aligned so it can be used straight from a mapping
+    static const uint8_t padding[alignof(FramePackEntry)] = {};
+    size_t paddingSize = (alignof(FramePackEntry) - m_packSize % alignof(FramePackEntry)) % alignof(FramePackEntry);
+
+    FramePackHeader header = {};
+    memcpy(header.magic, FRAME_PACK_MAGIC, sizeof(FRAME_PACK_MAGIC));
+    header.version = le32(FRAME_PACK_VERSION);
+    header.width = le32(m_width);
+    header.height = le32(m_height);
+    header.flags = le32((m_deltaEncoding ? FRAME_PACK_DELTA : 0) | (m_interlaced ? FRAME_PACK_INTERLACED : 0));
+    header.compression = le32((uint32_t)m_compression);
+    header.keyframeInterval = le32(m_keyframeInterval);
+    header.frameCount = le32(m_entries.size());
+    header.frameInterval = le32(m_frameInterval);
+    header.indexOffset = le64(m_packSize + paddingSize);
+
+    if(fwrite(padding, 1, paddingSize, m_pack) != paddingSize
+            || fwrite(m_entries.data(), sizeof(FramePackEntry), m_entries.size(), m_pack) != m_entries.size()
+            || fseek(m_pack, 0, SEEK_SET)
+            || fwrite(&header, sizeof(header), 1, m_pack) != 1
+            || fclose(m_pack)) {
+        Logger::Error("Error writing '{}': {}", m_packPath, strerror(errno));
+        std::terminate();
+    }
+
+    m_pack = nullptr;
+}
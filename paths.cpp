@@ -6,6 +6,7 @@
 #include <vector>
 
 #include <cassert>
+#include <filesystem>
 
 #include <limits.h>
 #include <unistd.h>
@@ -64,3 +65,38 @@ const char* get_run_path() {
     assert(runpath);
     return runpath;
 }
+
+std::string get_cache_dir() {
+    std::filesystem::path dir;
+    if(const char* xdgCache = getenv("XDG_CACHE_HOME"); xdgCache && *xdgCache) {
+        dir = xdgCache;
+    } else if(const char* home = getenv("HOME"); home && *home) {
+        dir = std::filesystem::path(home) / ".cache";
+    } else {
+        std::error_code err;
+        dir = std::filesystem::temp_directory_path(err);
+        if(err) {
+            return "";
+        }
+    }
+
+    dir /= "ttyapple";
+
+    std::error_code err;
+    std::filesystem::create_directories(dir, err);
+    if(err) {
+        Logger::Warning("Failed to create cache directory '{}': {}", dir.string(), err.message());
+        return "";
+    }
+
+    return dir.string();
+}
+
+uint64_t hash_bytes(uint64_t hash, std::string_view data) {
+    for(unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
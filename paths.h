@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
 std::vector<std::string> get_path_var();
@@ -10,3 +12,12 @@ std::string locate_executable(const std::vector<std::string>& paths,
 void find_run_path(char* argv0);
 // Returns the run path of this executable
 const char* get_run_path();
+
+// Directory for files kept between runs, created if it doesn't exist.
+// Returns an empty string if it could not be created
+std::string get_cache_dir();
+
+// FNV-1a, only used to tell cached files apart.
+// Start with HASH_BYTES_INITIAL then pass in the previous result
+#define HASH_BYTES_INITIAL 0xcbf29ce484222325
+uint64_t hash_bytes(uint64_t hash, std::string_view data);
@@ -0,0 +1,346 @@
+#include "recording.h"
+
+#include "logger.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <charconv>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TTYREC_HEADER_SIZE 12
+
+RecordingFormat recording_format_for_path(const char* path) {
+    if(std::string_view(path).ends_with(".cast")) {
+        return RecordingFormat::Asciicast;
+    }
+
+    return RecordingFormat::Ttyrec;
+}
+
+Recorder::~Recorder() {
+    if(m_file) {
+        fclose(m_file);
+    }
+}
+
+int Recorder::open(const char* path, RecordingFormat format, int columns, int rows) {
+    m_file = fopen(path, "wb");
+    if(!m_file) {
+        Logger::Error("Failed to open '{}' for writing: {}!", path, strerror(errno));
+        return 1;
+    }
+
+    m_format = format;
+    m_startTime = time(nullptr);
+
+    if(m_format == RecordingFormat::Asciicast) {
+        fmt::print(m_file, "{{\"version\": 2, \"width\": {}, \"height\": {}, \"timestamp\": {}}}\n",
+                columns, rows, m_startTime);
+    }
+
+    return 0;
+}
+
+void Recorder::write(long usTimestamp, const char* data, size_t size) {
+    if(m_firstTimestamp < 0) {
+        m_firstTimestamp = usTimestamp;
+    }
+
+    long elapsed = usTimestamp - m_firstTimestamp;
+
+    if(m_format == RecordingFormat::Ttyrec) {
+        uint32_t header[3] = {
+            (uint32_t)(m_startTime + elapsed / 1000000),
+            (uint32_t)(elapsed % 1000000),
+            (uint32_t)size,
+        };
+
+        uint8_t out[TTYREC_HEADER_SIZE];
+        for(int i = 0; i < TTYREC_HEADER_SIZE; i++) {
+            out[i] = header[i / 4] >> (i % 4 * 8);
+        }
+
+        fwrite(out, 1, sizeof(out), m_file);
+        fwrite(data, 1, size, m_file);
+        return;
+    }
+
+    // JSON strings can hold UTF-8 as is,
+    // only quotes, backslashes and control characters need escaping
+    std::string event = fmt::format("[{}.{:06}, \"o\", \"", elapsed / 1000000, elapsed % 1000000);
+    for(size_t i = 0; i < size; i++) {
+        unsigned char c = data[i];
+        if(c == '"' || c == '\\') {
+            event += '\\';
+            event += c;
+        } else if(c == '\n') {
+            event += "\\n";
+        } else if(c < 0x20 || c == 0x7f) {
+            event += fmt::format("\\u{:04x}", c);
+        } else {
+            event += c;
+        }
+    }
+    event += "\"]\n";
+
+    fwrite(event.data(), 1, event.size(), m_file);
+}
+
+static bool write_all(const char* data, size_t size) {
+    while(size > 0) {
+        ssize_t written = ::write(STDOUT_FILENO, data, size);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            Logger::Error("Failed to write to stdout: {}!", strerror(errno));
+            return false;
+        }
+
+        data += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+static void append_utf8(std::string& out, uint32_t c) {
+    if(c < 0x80) {
+        out += (char)c;
+    } else if(c < 0x800) {
+        out += (char)(0xc0 | (c >> 6));
+        out += (char)(0x80 | (c & 0x3f));
+    } else if(c < 0x10000) {
+        out += (char)(0xe0 | (c >> 12));
+        out += (char)(0x80 | ((c >> 6) & 0x3f));
+        out += (char)(0x80 | (c & 0x3f));
+    } else {
+        out += (char)(0xf0 | (c >> 18));
+        out += (char)(0x80 | ((c >> 12) & 0x3f));
+        out += (char)(0x80 | ((c >> 6) & 0x3f));
+        out += (char)(0x80 | (c & 0x3f));
+    }
+}
+
+// Unescapes the JSON string starting after the opening quote at p,
+// returns a pointer past the closing quote or nullptr if it is malformed
+static const char* parse_json_string(const char* p, const char* end, std::string& out) {
+    while(p < end && *p != '"') {
+        if(*p != '\\') {
+            out += *p++;
+            continue;
+        }
+
+        if(++p >= end) {
+            return nullptr;
+        }
+
+        char escape = *p++;
+        switch(escape) {
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u': {
+            uint32_t c = 0;
+            for(int i = 0; i < 4; i++, p++) {
+                unsigned char digit = p < end ? *p : 0;
+                if(!isxdigit(digit)) {
+                    return nullptr;
+                }
+
+                c = (c << 4) | (isdigit(digit) ? digit - '0' : (tolower(digit) - 'a' + 10));
+            }
+
+            // Characters outside the BMP are written as surrogate pairs
+            if(c >= 0xd800 && c < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                uint32_t low = strtoul(std::string(p + 2, 4).c_str(), nullptr, 16);
+                if(low >= 0xdc00 && low < 0xe000) {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                    p += 6;
+                }
+            }
+
+            append_utf8(out, c);
+            break;
+        }
+        default:
+            // \", \\ and \/
+            out += escape;
+            break;
+        }
+    }
+
+    if(p >= end) {
+        return nullptr;
+    }
+
+    return p + 1;
+}
+
+// Plays back recorded data, sleeping until each chunk is due
+class ReplayClock {
+public:
+    // Waits until usTimestamp after the first chunk
+    void wait(long usTimestamp) {
+        if(m_firstTimestamp < 0) {
+            m_firstTimestamp = usTimestamp;
+            m_start = std::chrono::steady_clock::now();
+            return;
+        }
+
+        std::this_thread::sleep_until(m_start + std::chrono::microseconds(usTimestamp - m_firstTimestamp));
+    }
+
+private:
+    long m_firstTimestamp = -1;
+    std::chrono::time_point<std::chrono::steady_clock> m_start;
+};
+
+static bool replay_ttyrec(const char* data, const char* end) {
+    ReplayClock clock;
+
+    while(end - data >= TTYREC_HEADER_SIZE) {
+        const uint8_t* header = (const uint8_t*)data;
+        uint32_t fields[3] = {};
+        for(int i = 0; i < TTYREC_HEADER_SIZE; i++) {
+            fields[i / 4] |= (uint32_t)header[i] << (i % 4 * 8);
+        }
+
+        data += TTYREC_HEADER_SIZE;
+
+        uint32_t size = fields[2];
+        if(size > (size_t)(end - data)) {
+            Logger::Error("Recording is truncated!");
+            return false;
+        }
+
+        clock.wait((long)fields[0] * 1000000 + fields[1]);
+
+        // Straight from the mapping, nothing is copied
+        if(!write_all(data, size)) {
+            return false;
+        }
+
+        data += size;
+    }
+
+    return true;
+}
+
+static bool replay_asciicast(const char* data, const char* end) {
+    ReplayClock clock;
+    std::string output;
+
+    // The first line is the header
+    const char* line = (const char*)memchr(data, '\n', end - data);
+    while(line && ++line < end) {
+        const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+        if(!lineEnd) {
+            lineEnd = end;
+        }
+
+        // Events look like [time, "o", "data"]
+        const char* p = line;
+        if(*p++ != '[') {
+            line = lineEnd;
+            continue;
+        }
+
+        while(p < lineEnd && *p == ' ') {
+            p++;
+        }
+
+        // The file isn't null terminated so strtod could run off the end
+        double time = 0;
+        const char* timeEnd = std::from_chars(p, lineEnd, time).ptr;
+
+        p = (const char*)memchr(timeEnd, '"', lineEnd - timeEnd);
+        if(!p || lineEnd - p < 4) {
+            Logger::Error("Malformed asciicast event!");
+            return false;
+        }
+
+        // Only output events are played back
+        if(p[1] != 'o') {
+            line = lineEnd;
+            continue;
+        }
+
+        p = (const char*)memchr(p + 3, '"', lineEnd - p - 3);
+        output.clear();
+        if(!p || !parse_json_string(p + 1, lineEnd, output)) {
+            Logger::Error("Malformed asciicast event!");
+            return false;
+        }
+
+        clock.wait(time * 1000000);
+        if(!write_all(output.data(), output.size())) {
+            return false;
+        }
+
+        line = lineEnd;
+    }
+
+    return true;
+}
+
+int replay_recording(const char* path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        Logger::Error("Failed to open '{}': {}!", path, strerror(errno));
+        return 1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st)) {
+        Logger::Error("Failed to stat '{}': {}!", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    if(st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(mapping == MAP_FAILED) {
+        Logger::Error("Failed to map '{}': {}!", path, strerror(errno));
+        return 1;
+    }
+
+    // The recording is read front to back once
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+    const char* data = (const char*)mapping;
+    const char* end = data + st.st_size;
+
+    bool played;
+    if(recording_format_for_path(path) == RecordingFormat::Asciicast) {
+        played = replay_asciicast(data, end);
+    } else {
+        played = replay_ttyrec(data, end);
+    }
+
+    munmap(mapping, st.st_size);
+    return !played;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+
+enum class RecordingFormat {
+    // asciinema's newline delimited JSON format
+    Asciicast,
+    // Binary records of a seconds, microseconds and length header
+    // (32-bit little endian each) followed by the bytes written
+    Ttyrec,
+};
+
+// Recordings ending in .cast are asciicast, anything else is ttyrec
+RecordingFormat recording_format_for_path(const char* path);
+
+// Records everything written to the terminal along with when it was written,
+// so it can be played back without decoding the video again
+class Recorder {
+public:
+    ~Recorder();
+
+    // Returns 0 on success
+    int open(const char* path, RecordingFormat format, int columns, int rows);
+
+    // usTimestamp is the presentation time of the frame the data belongs to
+    void write(long usTimestamp, const char* data, size_t size);
+
+private:
+    FILE* m_file = nullptr;
+    RecordingFormat m_format;
+
+    long m_firstTimestamp = -1;
+    // Wall clock time the recording started, ttyrec stores absolute times
+    long m_startTime;
+};
+
+// Writes out a recording to stdout with the recorded timing,
+// returns 0 on success
+int replay_recording(const char* path);
@@ -0,0 +1,369 @@
+#include "output.h"
+
+#include "frame.h"
+#include "logger.h"
+#include "stats.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define SERVER_MAX_EVENTS 64
+
+// Sent to every viewer when they connect
+static const std::shared_ptr<const std::string> greeting = std::make_shared<const std::string>(
+    // Telnet: IAC WILL ECHO, IAC WILL SUPPRESS-GO-AHEAD,
+    // so clients don't echo input or wait for a whole line
+    "\xff\xfb\x01\xff\xfb\x03"
+    // Clear the screen and hide the cursor
+    "\033[2J\033[?25l"
+);
+
+ServerOutput::ServerOutput(int width, int height)
+    : Output(width, height) {}
+
+ServerOutput::~ServerOutput() {
+    finish();
+}
+
+int ServerOutput::listen(int port) {
+    m_listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(m_listenSocket < 0) {
+        Logger::Error("Failed to create socket: {}!", strerror(errno));
+        return 1;
+    }
+
+    int reuse = 1;
+    setsockopt(m_listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    if(bind(m_listenSocket, (sockaddr*)&address, sizeof(address))) {
+        Logger::Error("Failed to bind to port {}: {}!", port, strerror(errno));
+        return 1;
+    }
+
+    if(::listen(m_listenSocket, SOMAXCONN)) {
+        Logger::Error("Failed to listen on port {}: {}!", port, strerror(errno));
+        return 1;
+    }
+
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    m_wakeEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_epoll < 0 || m_wakeEvent < 0) {
+        Logger::Error("Failed to create epoll instance: {}!", strerror(errno));
+        return 1;
+    }
+
+    for(int fd : {m_listenSocket, m_wakeEvent}) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if(epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event)) {
+            Logger::Error("epoll_ctl: {}!", strerror(errno));
+            return 1;
+        }
+    }
+
+    m_networkThread = std::thread(&ServerOutput::network_thread, this);
+
+    Logger::Debug("Listening on port {}", port);
+    return 0;
+}
+
+void ServerOutput::run() {
+    std::unique_lock lock{m_frameLock};
+    if(!m_nextFrame) {
+        return;
+    }
+
+    m_currentFrame = std::move(m_nextFrame);
+
+    lock.unlock();
+    m_frameCondition.notify_all();
+
+    // Every frame redraws the whole screen from the top left,
+    // so viewers can start from any frame
+    StageTimer convertTimer{Stage::Convert};
+    std::string frame = "\033[H";
+
+    std::vector<char> line;
+    for(int i = 0; i < m_height; i += 2) {
+        line.clear();
+        frame_data_to_string(m_currentFrame->data + i * m_width, m_currentFrame->data + (i + 1) * m_width, m_width, line);
+
+        // Leave out the null terminator
+        frame.append(line.data(), line.size() - 1);
+        if(i + 2 < m_height) {
+            frame += "\r\n";
+        }
+    }
+    convertTimer.stop();
+
+    lock.lock();
+
+    assert(!m_lastFrame);
+
+    long timestamp = m_currentFrame->usTimestamp;
+    m_lastFrame = std::move(m_currentFrame);
+
+    // We are done with the frame data
+    lock.unlock();
+    m_frameCondition.notify_all();
+
+    StageTimer paceTimer{Stage::Pace};
+    if(m_firstFrameTimestamp < 0) {
+        m_firstFrameTimestamp = timestamp;
+        m_startTime = std::chrono::steady_clock::now();
+    } else {
+        std::this_thread::sleep_until(m_startTime + std::chrono::microseconds(timestamp - m_firstFrameTimestamp));
+    }
+    paceTimer.stop();
+
+    stats_add(Counter::FramesOutput);
+
+    auto newestFrame = std::make_shared<const std::string>(std::move(frame));
+
+    // The old frame is freed after unlocking, unless a viewer still has it
+    std::unique_lock newestLock{m_newestFrameLock};
+    std::swap(m_newestFrame, newestFrame);
+    m_newestSequence++;
+    newestLock.unlock();
+
+    uint64_t wake = 1;
+    if(write(m_wakeEvent, &wake, sizeof(wake)) < 0 && errno != EAGAIN) {
+        Logger::Warning("Failed to wake network thread: {}", strerror(errno));
+    }
+}
+
+void ServerOutput::finish() {
+    if(!m_networkThread.joinable()) {
+        return;
+    }
+
+    std::unique_lock lock{m_newestFrameLock};
+    m_stop = true;
+    lock.unlock();
+
+    uint64_t wake = 1;
+    write(m_wakeEvent, &wake, sizeof(wake));
+
+    m_networkThread.join();
+
+    close(m_wakeEvent);
+    close(m_epoll);
+    close(m_listenSocket);
+}
+
+std::shared_ptr<const std::string> ServerOutput::newest_frame(uint64_t& sequence) {
+    std::unique_lock lock{m_newestFrameLock};
+
+    sequence = m_newestSequence;
+    return m_newestFrame;
+}
+
+void ServerOutput::network_thread() {
+    trace_set_thread_name("network");
+
+    epoll_event events[SERVER_MAX_EVENTS];
+    std::vector<int> disconnected;
+
+    while(true) {
+        int count = epoll_wait(m_epoll, events, SERVER_MAX_EVENTS, -1);
+        if(count < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            Logger::Error("epoll_wait: {}!", strerror(errno));
+            break;
+        }
+
+        bool newFrame = false;
+        for(int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if(fd == m_listenSocket) {
+                accept_clients();
+                continue;
+            } else if(fd == m_wakeEvent) {
+                uint64_t value;
+                read(m_wakeEvent, &value, sizeof(value));
+
+                newFrame = true;
+                continue;
+            }
+
+            auto it = m_clients.find(fd);
+            if(it == m_clients.end()) {
+                continue;
+            }
+
+            Client& client = it->second;
+            bool connected = !(events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP));
+
+            // Nothing viewers send matters, just keep the socket drained
+            if(connected && (events[i].events & EPOLLIN)) {
+                char buf[512];
+                ssize_t result = recv(fd, buf, sizeof(buf), 0);
+                if(result == 0 || (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    connected = false;
+                }
+            }
+
+            if(connected && (events[i].events & EPOLLOUT)) {
+                connected = send_to_client(client);
+            }
+
+            if(!connected) {
+                close_client(client);
+            }
+        }
+
+        if(newFrame) {
+            // Clients still busy with an older frame
+            // pick up the newest one when they are done
+            for(auto& [fd, client] : m_clients) {
+                if(!client.frame && !send_to_client(client)) {
+                    disconnected.push_back(fd);
+                }
+            }
+
+            for(int fd : disconnected) {
+                close_client(m_clients.at(fd));
+            }
+            disconnected.clear();
+        }
+
+        std::unique_lock lock{m_newestFrameLock};
+        if(m_stop) {
+            break;
+        }
+    }
+
+    for(auto& [fd, client] : m_clients) {
+        close(fd);
+    }
+    m_clients.clear();
+}
+
+void ServerOutput::accept_clients() {
+    while(true) {
+        int fd = accept4(m_listenSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                Logger::Warning("Failed to accept viewer: {}", strerror(errno));
+            }
+            return;
+        }
+
+        // Frames are sent in one go, there is nothing to gain by waiting
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        if(epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event)) {
+            Logger::Warning("epoll_ctl: {}", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        Client& client = m_clients[fd];
+        client.fd = fd;
+        client.frame = greeting;
+
+        if(!send_to_client(client)) {
+            close_client(client);
+            continue;
+        }
+
+        Logger::Debug("Viewer connected, {} watching", m_clients.size());
+    }
+}
+
+bool ServerOutput::send_to_client(Client& client) {
+    while(true) {
+        if(!client.frame || client.offset == client.frame->size()) {
+            uint64_t sequence;
+            std::shared_ptr<const std::string> frame = newest_frame(sequence);
+
+            // Wait for the next frame if the client is up to date
+            if(!frame || sequence == client.sequence) {
+                client.frame = nullptr;
+                break;
+            }
+
+            // Any frames in between are skipped
+            client.frame = std::move(frame);
+            client.sequence = sequence;
+            client.offset = 0;
+        }
+
+        StageTimer writeTimer{Stage::Write};
+        ssize_t written = send(client.fd, client.frame->data() + client.offset,
+                client.frame->size() - client.offset, MSG_NOSIGNAL);
+        writeTimer.stop();
+
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            } else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+
+            // Socket buffer is full, carry on when there is room
+            if(!client.blocked) {
+                epoll_event event = {};
+                event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+                event.data.fd = client.fd;
+                epoll_ctl(m_epoll, EPOLL_CTL_MOD, client.fd, &event);
+
+                client.blocked = true;
+            }
+            return true;
+        }
+
+        client.offset += written;
+        stats_add(Counter::BytesWritten, written);
+    }
+
+    if(client.blocked) {
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = client.fd;
+        epoll_ctl(m_epoll, EPOLL_CTL_MOD, client.fd, &event);
+
+        client.blocked = false;
+    }
+
+    return true;
+}
+
+void ServerOutput::close_client(Client& client) {
+    int fd = client.fd;
+
+    // Closing the socket also removes it from the epoll set
+    close(fd);
+    m_clients.erase(fd);
+
+    Logger::Debug("Viewer disconnected, {} watching", m_clients.size());
+}
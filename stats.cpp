@@ -0,0 +1,301 @@
+#include "stats.h"
+
+#include "logger.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+// Bucket i holds times from 2^i up to 2^(i + 1) nanoseconds,
+// anything longer than the last bucket goes in the last bucket
+#define STATS_HISTOGRAM_BUCKETS 40
+
+// Several threads record the same stages so everything is atomic,
+// nothing needs ordering with anything else
+struct StageStats {
+    std::atomic<uint64_t> totalNs;
+    std::atomic<uint64_t> maxNs;
+    std::atomic<uint64_t> buckets[STATS_HISTOGRAM_BUCKETS];
+};
+
+static StageStats stages[(int)Stage::Count];
+static std::atomic<uint64_t> counters[(int)Counter::Count];
+
+static std::chrono::steady_clock::time_point startTime;
+static std::string jsonPath;
+
+static const char* stageNames[] = {
+    "demux",
+    "decode",
+    "scale",
+    "acquire_wait",
+    "send_wait",
+    "convert",
+    "pace",
+    "write",
+};
+static_assert(std::size(stageNames) == (size_t)Stage::Count);
+
+static const char* counterNames[] = {
+    "packets",
+    "frames_decoded",
+    "frames_output",
+    "bytes_written",
+};
+static_assert(std::size(counterNames) == (size_t)Counter::Count);
+
+// Copy of a stage's stats that won't change while it is being printed
+struct StageSnapshot {
+    uint64_t count = 0;
+    uint64_t totalNs = 0;
+    uint64_t maxNs = 0;
+    uint64_t buckets[STATS_HISTOGRAM_BUCKETS] = {};
+
+    // Upper bound of the bucket the given fraction of samples fall under
+    uint64_t percentile(double fraction) const {
+        uint64_t target = count * fraction;
+        uint64_t seen = 0;
+        for(int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+            seen += buckets[i];
+            if(seen > target) {
+                return std::min<uint64_t>(2ull << i, maxNs);
+            }
+        }
+
+        return maxNs;
+    }
+};
+
+static StageSnapshot snapshot(Stage stage) {
+    StageStats& stats = stages[(int)stage];
+
+    StageSnapshot s;
+    for(int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        s.buckets[i] = stats.buckets[i].load(std::memory_order_relaxed);
+        s.count += s.buckets[i];
+    }
+
+    s.totalNs = stats.totalNs.load(std::memory_order_relaxed);
+    s.maxNs = stats.maxNs.load(std::memory_order_relaxed);
+    return s;
+}
+
+static double elapsed_seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+// Waits on SIGUSR1, SIGINT and SIGTERM for the stats and trace,
+// stopped before either is written at exit
+static std::thread signalThread;
+static std::atomic<bool> stopSignalThread = false;
+static std::once_flag signalThreadStarted;
+
+static void dump_stats() {
+    // SIGUSR1 can arrive while dumping at exit
+    static std::mutex dumpLock;
+    std::unique_lock lock{dumpLock};
+
+    stats_print_summary(stderr);
+
+    if(!jsonPath.empty()) {
+        stats_write_json(jsonPath.c_str());
+    }
+}
+
+static void handled_signals(sigset_t* signals) {
+    sigemptyset(signals);
+    sigaddset(signals, SIGUSR1);
+    sigaddset(signals, SIGINT);
+    sigaddset(signals, SIGTERM);
+}
+
+static void signal_thread() {
+    sigset_t signals;
+    handled_signals(&signals);
+
+    while(true) {
+        int signal;
+        if(sigwait(&signals, &signal)) {
+            return;
+        }
+
+        if(signal == SIGUSR1) {
+            if(stopSignalThread.load(std::memory_order_acquire)) {
+                return;
+            }
+
+            if(statsEnabled) {
+                dump_stats();
+            }
+            continue;
+        }
+
+        // Interrupted, exit handlers don't run when killed by a signal
+        stopSignalThread.store(true, std::memory_order_release);
+        if(statsEnabled) {
+            dump_stats();
+        }
+
+        if(traceEnabled) {
+            trace_finish();
+        }
+
+        // Then let the signal stop the process as it would have
+        struct sigaction action = {};
+        action.sa_handler = SIG_DFL;
+        sigaction(signal, &action, nullptr);
+
+        sigset_t raised;
+        sigemptyset(&raised);
+        sigaddset(&raised, signal);
+        pthread_sigmask(SIG_UNBLOCK, &raised, nullptr);
+        raise(signal);
+        return;
+    }
+}
+
+static void stop_signal_thread() {
+    // Woken with its own signal
+    stopSignalThread.store(true, std::memory_order_release);
+    if(signalThread.joinable()) {
+        pthread_kill(signalThread.native_handle(), SIGUSR1);
+        signalThread.join();
+    }
+}
+
+void start_signal_thread() {
+    std::call_once(signalThreadStarted, [] {
+        // Every thread started after this inherits the mask,
+        // so these signals only ever go to the signal thread where
+        // it is safe to print
+        sigset_t signals;
+        handled_signals(&signals);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+        signalThread = std::thread(signal_thread);
+
+        atexit(stop_signal_thread);
+    });
+}
+
+static void dump_stats_at_exit() {
+    // Make sure nothing else is dumping the stats
+    stop_signal_thread();
+    dump_stats();
+}
+
+void stats_enable(const char* path) {
+    startTime = std::chrono::steady_clock::now();
+    if(path) {
+        jsonPath = path;
+    }
+
+    statsEnabled = true;
+
+    atexit(dump_stats_at_exit);
+    start_signal_thread();
+}
+
+void stats_record_time(Stage stage, uint64_t ns) {
+    StageStats& stats = stages[(int)stage];
+
+    int bucket = std::min(std::max((int)std::bit_width(ns) - 1, 0), STATS_HISTOGRAM_BUCKETS - 1);
+    stats.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    stats.totalNs.fetch_add(ns, std::memory_order_relaxed);
+
+    uint64_t max = stats.maxNs.load(std::memory_order_relaxed);
+    while(ns > max && !stats.maxNs.compare_exchange_weak(max, ns, std::memory_order_relaxed));
+}
+
+void stats_record_count(Counter counter, uint64_t amount) {
+    counters[(int)counter].fetch_add(amount, std::memory_order_relaxed);
+}
+
+const char* stage_name(Stage stage) {
+    return stageNames[(int)stage];
+}
+
+void stats_print_summary(FILE* out) {
+    fmt::print(out, "Stats after {:.2f}s:\n", elapsed_seconds());
+    fmt::print(out, "  {:<14}{:>10}{:>12}{:>10}{:>10}{:>10}{:>10}{:>10}\n",
+               "stage", "count", "total ms", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+
+    for(int i = 0; i < (int)Stage::Count; i++) {
+        StageSnapshot s = snapshot((Stage)i);
+        if(!s.count) {
+            continue;
+        }
+
+        fmt::print(out, "  {:<14}{:>10}{:>12.1f}{:>10.2f}{:>10.2f}{:>10.2f}{:>10.2f}{:>10.2f}\n",
+                   stageNames[i], s.count, s.totalNs / 1e6, s.totalNs / 1e3 / s.count,
+                   s.percentile(0.5) / 1e3, s.percentile(0.9) / 1e3, s.percentile(0.99) / 1e3, s.maxNs / 1e3);
+    }
+
+    for(int i = 0; i < (int)Counter::Count; i++) {
+        fmt::print(out, "  {:<14}{:>10}\n", counterNames[i], counters[i].load(std::memory_order_relaxed));
+    }
+
+    fflush(out);
+}
+
+int stats_write_json(const char* path) {
+    std::string json = fmt::format("{{\n  \"elapsed_s\": {:.6f},\n  \"stages\": {{", elapsed_seconds());
+
+    const char* separator = "\n";
+    for(int i = 0; i < (int)Stage::Count; i++) {
+        StageSnapshot s = snapshot((Stage)i);
+
+        json += fmt::format("{}    \"{}\": {{\"count\": {}, \"total_ns\": {}, \"max_ns\": {}, "
+                            "\"p50_ns\": {}, \"p90_ns\": {}, \"p99_ns\": {}, \"log2_ns_histogram\": [",
+                            separator, stageNames[i], s.count, s.totalNs, s.maxNs,
+                            s.percentile(0.5), s.percentile(0.9), s.percentile(0.99));
+
+        for(int b = 0; b < STATS_HISTOGRAM_BUCKETS; b++) {
+            json += fmt::format("{}{}", b ? ", " : "", s.buckets[b]);
+        }
+
+        json += "]}";
+        separator = ",\n";
+    }
+
+    json += "\n  },\n  \"counters\": {";
+
+    separator = "\n";
+    for(int i = 0; i < (int)Counter::Count; i++) {
+        json += fmt::format("{}    \"{}\": {}", separator, counterNames[i], counters[i].load(std::memory_order_relaxed));
+        separator = ",\n";
+    }
+
+    json += "\n  }\n}\n";
+
+    // Written somewhere else first so nothing ever sees half a file
+    std::string partialPath = fmt::format("{}.tmp", path);
+    FILE* file = fopen(partialPath.c_str(), "w");
+    if(!file) {
+        Logger::Error("Failed to open '{}': {}", partialPath, strerror(errno));
+        return 1;
+    }
+
+    bool failed = fwrite(json.data(), 1, json.size(), file) != json.size();
+    failed |= fclose(file) != 0;
+
+    if(failed || rename(partialPath.c_str(), path)) {
+        Logger::Error("Failed to write '{}': {}", path, strerror(errno));
+        unlink(partialPath.c_str());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "trace.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+// Steps a frame goes through between the video file and the output
+enum class Stage {
+    // Reading packets from the file
+    Demux,
+    // Sending packets to and receiving frames from the codec
+    Decode,
+    // Resizing frames to the output size
+    Scale,
+    // Decoder waiting for a free frame from the output
+    AcquireWait,
+    // Decoder waiting for the output to take the previous frame
+    SendWait,
+    // Output turning a frame into text or packed data
+    Convert,
+    // Output sleeping until the frame is due
+    Pace,
+    // Output writing the frame out
+    Write,
+    Count,
+};
+
+enum class Counter {
+    Packets,
+    FramesDecoded,
+    FramesOutput,
+    BytesWritten,
+    Count,
+};
+
+// Only set by stats_enable before any threads are started,
+// so when stats are off instrumentation costs a single check
+inline bool statsEnabled = false;
+
+// Start collecting stats. A summary is printed to stderr on SIGUSR1 and at exit,
+// including when stopped by SIGINT or SIGTERM, and if jsonPath is not null
+// the stats are also written there as JSON.
+// Must be called before any other threads are started
+void stats_enable(const char* jsonPath);
+
+// Handles SIGUSR1, SIGINT and SIGTERM on a thread of its own so the stats and
+// trace are still written when interrupted, only the first call starts it.
+// Must be called before any other threads are started
+void start_signal_thread();
+
+void stats_record_time(Stage stage, uint64_t ns);
+void stats_record_count(Counter counter, uint64_t amount);
+
+inline void stats_add(Counter counter, uint64_t amount = 1) {
+    if(statsEnabled) {
+        stats_record_count(counter, amount);
+    }
+}
+
+const char* stage_name(Stage stage);
+
+void stats_print_summary(FILE* out);
+// Returns 0 on success
+int stats_write_json(const char* path);
+
+// Times a stage from construction until stop is called or it goes out of scope,
+// for the stats and as a span in the trace
+class StageTimer {
+public:
+    inline StageTimer(Stage stage)
+        : m_stage(stage) {
+        if(statsEnabled || traceEnabled) {
+            m_start = std::chrono::steady_clock::now();
+        }
+    }
+
+    inline ~StageTimer() {
+        stop();
+    }
+
+    inline void stop() {
+        if((statsEnabled || traceEnabled) && m_stage != Stage::Count) {
+            auto end = std::chrono::steady_clock::now();
+            if(statsEnabled) {
+                stats_record_time(m_stage, std::chrono::duration_cast<std::chrono::nanoseconds>(end - m_start).count());
+            }
+
+            if(traceEnabled) {
+                trace_record_span(m_stage, m_start, end);
+            }
+
+            m_stage = Stage::Count;
+        }
+    }
+
+private:
+    Stage m_stage;
+    std::chrono::steady_clock::time_point m_start;
+};
@@ -2,9 +2,14 @@
 
 #include "frame.h"
 #include "logger.h"
+#include "stats.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
 
 #include <unistd.h>
 #include <time.h>
@@ -19,15 +24,42 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
+// How frames are resized to the output size
+#define RESCALER_FLAGS SWS_BILINEAR
+
+// Memory shared between the segments for frames decoded ahead of the output,
+// past this their threads wait rather than holding the whole video in memory
+#define SEGMENT_FRAME_BUDGET (64 * 1024 * 1024)
+// Frames each segment can queue however big the frames are
+#define SEGMENT_MIN_FRAMES 4
+
+static int read_packet(AVFormatContext* avfmt, AVPacket* packet) {
+    StageTimer timer{Stage::Demux};
+
+    int ret = av_read_frame(avfmt, packet);
+    if (ret >= 0) {
+        stats_add(Counter::Packets);
+    }
+
+    return ret;
+}
+
 StreamContext::StreamContext() {
     m_decoderThread = std::thread(&StreamContext::decode, this);
 }
 
 StreamContext::~StreamContext() {
-    m_shouldThreadsDie = true;
-
     // Wait for playback to stop before exiting
     playback_stop();
+
+    {
+        std::unique_lock lockStatus{m_decoderStatusLock};
+        m_shouldThreadsDie = true;
+    }
+
+    // Wake the decoder thread if it is waiting for a track
+    decoderShouldRunCondition.notify_all();
+    m_decoderThread.join();
 }
 
 void StreamContext::set_output_format(int outputWidth, int outputHeight) {
@@ -41,11 +73,20 @@ void StreamContext::set_output_format(int outputWidth, int outputHeight) {
     }
 }
 
-void StreamContext::decode_video(AVPacket* packet) {
-    AVFrame* frame = av_frame_alloc();
+void StreamContext::set_segment_count(int count) {
+    assert(count > 0);
 
+    std::unique_lock lockStatus{m_decoderStatusLock};
+    m_segmentCount = count;
+}
+
+void StreamContext::decode_video(AVPacket* packet, AVFrame* frame) {
     // Send the packet to the decoder
-    if (int ret = avcodec_send_packet(m_vcodec, packet); ret) {
+    StageTimer sendTimer{Stage::Decode};
+    int sendResult = avcodec_send_packet(m_vcodec, packet);
+    sendTimer.stop();
+
+    if (sendResult) {
         printf("Could not send packet for decoding");
         return;
     }
@@ -53,7 +94,10 @@ void StreamContext::decode_video(AVPacket* packet) {
     ssize_t ret = 0;
     while (!is_decoder_packet_invalid() && ret >= 0) {
         // Decodes the audio
+        StageTimer receiveTimer{Stage::Decode};
         ret = avcodec_receive_frame(m_vcodec, frame);
+        receiveTimer.stop();
+
         if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
             // Get the next packet and retry
             break;
@@ -67,13 +111,17 @@ void StreamContext::decode_video(AVPacket* packet) {
         std::unique_lock lockSurface{surfaceLock};
 
         int stride = m_outputWidth;
-        Frame* buffer = acquire_buffer();
+        FrameHandle buffer = acquire_buffer();
 
+        StageTimer scaleTimer{Stage::Scale};
         sws_scale(m_rescaler, frame->data, frame->linesize, 0, m_vcodec->height, &buffer->data, &stride);
+        scaleTimer.stop();
+        stats_add(Counter::FramesDecoded);
+
         // PTS is in milliseconds
         buffer->usTimestamp = (long)(frame->best_effort_timestamp * (av_q2d(m_videoStream->time_base) * 1000000));
 
-        push_buffer(buffer);
+        push_buffer(std::move(buffer));
         m_lastTimestamp = frame->best_effort_timestamp / 1000.0;
 
         av_frame_unref(frame);
@@ -83,10 +131,15 @@ void StreamContext::decode_video(AVPacket* packet) {
 }
 
 void StreamContext::decode() {
+    trace_set_thread_name("decoder");
+
     while (!m_shouldThreadsDie) {
         {
             std::unique_lock lockStatus{m_decoderStatusLock};
-            decoderShouldRunCondition.wait(lockStatus, [this]() -> bool { return m_isDecoderRunning; });
+            decoderShouldRunCondition.wait(lockStatus, [this]() -> bool { return m_isDecoderRunning || m_shouldThreadsDie; });
+            if (m_shouldThreadsDie) {
+                break;
+            }
         }
 
         m_decoderLock.lock();
@@ -96,15 +149,24 @@ void StreamContext::decode() {
         // Reset the sample buffer read and write indexes
         numValidBuffers = 0;
 
-        AVPacket* packet = av_packet_alloc();
-
         int frameResult = 0;
-        while (m_isDecoderRunning && (frameResult = av_read_frame(m_avfmt, packet)) >= 0) {
-            if (packet->stream_index == m_videoStreamIndex) {
-                decode_video(packet);
-            } else {
-                av_packet_unref(packet);
+        if (m_segmentCount > 1) {
+            frameResult = decode_segmented();
+        } else {
+            AVPacket* packet = av_packet_alloc();
+            // Reused for every frame of the track
+            AVFrame* frame = av_frame_alloc();
+
+            while (m_isDecoderRunning && (frameResult = read_packet(m_avfmt, packet)) >= 0) {
+                if (packet->stream_index == m_videoStreamIndex) {
+                    decode_video(packet, frame);
+                } else {
+                    av_packet_unref(packet);
+                }
             }
+
+            av_frame_free(&frame);
+            av_packet_free(&packet);
         }
 
         // If we got to the end of file (did not encounter errors)
@@ -132,6 +194,278 @@ void StreamContext::decode() {
     }
 }
 
+int StreamContext::decode_segmented() {
+    // Only demux the file to find where the keyframes are,
+    // this is cheap compared to actually decoding it
+    std::vector<int64_t> keyframes;
+
+    AVPacket* packet = av_packet_alloc();
+
+    int frameResult = 0;
+    while (m_isDecoderRunning && (frameResult = read_packet(m_avfmt, packet)) >= 0) {
+        if (packet->stream_index == m_videoStreamIndex && (packet->flags & AV_PKT_FLAG_KEY)) {
+            int64_t pts = packet->pts == AV_NOPTS_VALUE ? packet->dts : packet->pts;
+            if (pts != AV_NOPTS_VALUE) {
+                keyframes.push_back(pts);
+            }
+        }
+
+        av_packet_unref(packet);
+    }
+
+    av_packet_free(&packet);
+
+    std::sort(keyframes.begin(), keyframes.end());
+
+    // Spread the segments evenly over the keyframes
+    std::vector<std::unique_ptr<Segment>> segments;
+    for (int i = 0; i < m_segmentCount; i++) {
+        size_t k = keyframes.size() * i / m_segmentCount;
+        // The first segment gets anything before the first keyframe
+        int64_t start = i ? keyframes[k] : INT64_MIN;
+
+        if (!segments.empty() && segments.back()->startPts >= start) {
+            // Not enough keyframes for this many segments
+            continue;
+        }
+
+        if (!segments.empty()) {
+            segments.back()->endPts = start;
+        }
+
+        auto segment = std::make_unique<Segment>();
+        segment->startPts = start;
+        segment->endPts = INT64_MAX;
+        segments.push_back(std::move(segment));
+    }
+
+    // Later segments need enough room to keep decoding until the output gets to them
+    size_t frameSize = (size_t)m_outputWidth * m_outputHeight;
+    int segmentFrames = std::max<size_t>(SEGMENT_FRAME_BUDGET / frameSize / segments.size(), SEGMENT_MIN_FRAMES);
+    for (auto& segment : segments) {
+        segment->pool = std::make_unique<FramePool>(m_outputWidth, m_outputHeight, segmentFrames);
+    }
+
+    Logger::Debug("Decoding {} keyframes in {} segments of up to {} queued frames", keyframes.size(),
+                  segments.size(), segmentFrames);
+
+    std::vector<std::thread> threads;
+    for (auto& segment : segments) {
+        threads.emplace_back(&StreamContext::decode_segment, this, segment.get());
+    }
+
+    // Hand the frames to the output in order,
+    // the later segments keep decoding in the meantime
+    for (auto& segment : segments) {
+        while (true) {
+            std::unique_lock lock{segment->lock};
+            segment->condition.wait(lock, [&]() -> bool { return segment->done || !segment->frames.empty(); });
+
+            if (segment->frames.empty()) {
+                break;
+            }
+
+            FrameHandle decoded = std::move(segment->frames.front());
+            segment->frames.pop_front();
+            lock.unlock();
+
+            if (m_isDecoderRunning) {
+                std::unique_lock lockSurface{surfaceLock};
+
+                FrameHandle buffer = acquire_buffer();
+                memcpy(buffer->data, decoded->data, segment->pool->frame_size());
+                buffer->usTimestamp = decoded->usTimestamp;
+
+                push_buffer(std::move(buffer));
+            }
+
+            // Given back under the lock so the segment thread can't miss it
+            lock.lock();
+            decoded.reset();
+            lock.unlock();
+            segment->condition.notify_all();
+        }
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // The demux pass always reaches the end of the file,
+    // the video was only decoded to the end if every segment was
+    bool failed = !m_isDecoderRunning;
+    for (auto& segment : segments) {
+        failed |= segment->failed;
+    }
+
+    if (failed && frameResult == AVERROR_EOF) {
+        return AVERROR(EIO);
+    }
+
+    return frameResult;
+}
+
+void StreamContext::decode_segment(Segment* segment) {
+    trace_set_thread_name("segment decoder");
+
+    AVFormatContext* avfmt = nullptr;
+    AVCodecContext* vcodec = nullptr;
+    SwsContext* rescaler = nullptr;
+    AVPacket* packet = nullptr;
+    AVFrame* frame = nullptr;
+
+    AVStream* stream = nullptr;
+    const AVCodec* decoder = nullptr;
+
+    // Set once every frame in the segment has been decoded
+    bool finished = false;
+    bool decodeError = false;
+    int readResult = 0;
+
+    // Only frames within the segment are kept,
+    // returns false once we are past the end of the segment
+    auto receiveFrames = [&]() -> bool {
+        while (m_isDecoderRunning) {
+            StageTimer receiveTimer{Stage::Decode};
+            int ret = avcodec_receive_frame(vcodec, frame);
+            receiveTimer.stop();
+
+            if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
+                return true;
+            } else if (ret) {
+                Logger::Error("Could not decode frame: {}", ret);
+                decodeError = true;
+                return false;
+            }
+
+            int64_t pts = frame->best_effort_timestamp;
+            if (pts >= segment->endPts) {
+                av_frame_unref(frame);
+                finished = true;
+                return false;
+            }
+
+            if (pts >= segment->startPts) {
+                FrameHandle decoded;
+                std::unique_lock lock{segment->lock};
+                segment->condition.wait(lock, [&]() -> bool {
+                    return (decoded = segment->pool->acquire()) || !m_isDecoderRunning;
+                });
+                lock.unlock();
+
+                if (!decoded) {
+                    av_frame_unref(frame);
+                    return false;
+                }
+
+                decoded->usTimestamp = (long)(pts * (av_q2d(stream->time_base) * 1000000));
+
+                uint8_t* data = decoded->data;
+                int stride = m_outputWidth;
+                StageTimer scaleTimer{Stage::Scale};
+                sws_scale(rescaler, frame->data, frame->linesize, 0, vcodec->height, &data, &stride);
+                scaleTimer.stop();
+                stats_add(Counter::FramesDecoded);
+
+                lock.lock();
+                segment->frames.push_back(std::move(decoded));
+                lock.unlock();
+                segment->condition.notify_all();
+            }
+
+            av_frame_unref(frame);
+        }
+
+        return false;
+    };
+
+    if (avformat_open_input(&avfmt, m_filePath.c_str(), NULL, NULL)) {
+        Logger::Error("Failed to open {}", m_filePath);
+        goto done;
+    }
+
+    if (avformat_find_stream_info(avfmt, NULL) < 0) {
+        Logger::Error("Failed to get stream info for {}", m_filePath);
+        goto done;
+    }
+
+    stream = avfmt->streams[m_videoStreamIndex];
+    decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (!decoder) {
+        Logger::Error("Failed to find codec for '{}'", m_filePath);
+        goto done;
+    }
+
+    vcodec = avcodec_alloc_context3(decoder);
+    assert(vcodec);
+
+    if (avcodec_parameters_to_context(vcodec, stream->codecpar) || avcodec_open2(vcodec, decoder, NULL) < 0) {
+        Logger::Error("Failed to open codec!");
+        goto done;
+    }
+
+    rescaler = sws_getContext(vcodec->width, vcodec->height, vcodec->pix_fmt, m_outputWidth,
+                              m_outputHeight, AV_PIX_FMT_GRAY8, RESCALER_FLAGS, NULL, NULL, NULL);
+
+    if (segment->startPts != INT64_MIN &&
+        av_seek_frame(avfmt, m_videoStreamIndex, segment->startPts, AVSEEK_FLAG_BACKWARD) < 0) {
+        Logger::Error("Failed to seek to segment at {}", segment->startPts);
+        goto done;
+    }
+
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+
+    // Keep reading past the start of the next segment until a frame belonging
+    // to it comes out, as leading B-frames may still belong to this segment
+    while ((readResult = read_packet(avfmt, packet)) >= 0) {
+        if (packet->stream_index != m_videoStreamIndex) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        StageTimer sendTimer{Stage::Decode};
+        int ret = avcodec_send_packet(vcodec, packet);
+        sendTimer.stop();
+
+        av_packet_unref(packet);
+
+        if (ret) {
+            Logger::Error("Could not send packet for decoding");
+            goto done;
+        }
+
+        if (!receiveFrames()) {
+            goto done;
+        }
+    }
+
+    if (readResult != AVERROR_EOF) {
+        goto done;
+    }
+
+    // Flush any frames left in the decoder at the end of the file
+    avcodec_send_packet(vcodec, NULL);
+    receiveFrames();
+
+    if (!decodeError && m_isDecoderRunning) {
+        finished = true;
+    }
+
+done:
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    sws_freeContext(rescaler);
+    avcodec_free_context(&vcodec);
+    avformat_close_input(&avfmt);
+
+    std::unique_lock lock{segment->lock};
+    segment->done = true;
+    segment->failed = !finished;
+    lock.unlock();
+    segment->condition.notify_all();
+}
+
 void StreamContext::decoder_do_seek() {
     assert(m_requestSeek);
 
@@ -150,7 +484,11 @@ void StreamContext::initialize_rescaler() {
     }
 
     m_rescaler = sws_getContext(m_vcodec->width, m_vcodec->height, m_vcodec->pix_fmt, m_outputWidth,
-                                m_outputHeight, AV_PIX_FMT_GRAY8, SWS_BILINEAR, NULL, NULL, NULL);
+                                m_outputHeight, AV_PIX_FMT_GRAY8, RESCALER_FLAGS, NULL, NULL, NULL);
+}
+
+int StreamContext::rescaler_flags() {
+    return RESCALER_FLAGS;
 }
 
 float StreamContext::playback_progress() const {
@@ -195,6 +533,7 @@ int StreamContext::play_track(std::string file) {
 
     assert(!m_avfmt);
     m_avfmt = avformat_alloc_context();
+    m_filePath = file;
 
     // Opens the audio file
     if (int err = avformat_open_input(&m_avfmt, file.c_str(), NULL, NULL); err) {
@@ -2,9 +2,15 @@
 
 #pragma once
 
+#include "frame.h"
+
 #include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
 class StreamContext {
     friend void PlayAudio(StreamContext*);
@@ -22,8 +28,17 @@ public:
     ~StreamContext();
 
     void set_output_format(int outputWidth, int outputHeight);
+    // Split the file at keyframes into count segments that are decoded
+    // in parallel, only useful when there is no real-time constraint.
+    // Takes effect on the next call to play_track.
+    void set_segment_count(int count);
 
     inline bool is_playing() const { return m_isDecoderRunning; }
+    // Whether the last track was decoded all the way through
+    inline bool reached_end_of_file() const { return m_endOfFile; }
+
+    // sws_scale flags frames are resized with
+    static int rescaler_flags();
 
     // Gets progress into song in seconds
     float playback_progress() const;
@@ -47,13 +62,35 @@ public:
     // Lock when using/changing m_surface
     std::mutex surfaceLock;
 
-    struct Frame*(*acquire_buffer)() = nullptr;
-    void(*push_buffer)(struct Frame*) = nullptr;
+    FrameHandle(*acquire_buffer)() = nullptr;
+    void(*push_buffer)(FrameHandle) = nullptr;
 
 private:
+    // Part of the file decoded by its own thread and codec context
+    struct Segment {
+        // Only frames with start <= pts < end belong to this segment
+        int64_t startPts;
+        int64_t endPts;
+
+        std::mutex lock;
+        std::condition_variable condition;
+        // Frames decoded ahead of the output come from the segment's own pool,
+        // its thread waits for one to be given back once they are all queued
+        std::unique_ptr<FramePool> pool;
+        std::deque<FrameHandle> frames;
+        bool done = false;
+        // Stopped before the end of the segment
+        bool failed = false;
+    };
+
     // Decoder Loop
     void decode();
-    void decode_video(struct AVPacket* packet);
+    // Decodes packet into frame and pushes anything that comes out
+    void decode_video(struct AVPacket* packet, struct AVFrame* frame);
+    // Decode the file in m_segmentCount segments on separate threads
+    // and push the frames in order, returns the last av_read_frame result
+    int decode_segmented();
+    void decode_segment(Segment* segment);
     // Decodes a frame of audio and fills the next available buffer
     void decoder_decode_frame(struct AVFrame* frame);
     // Perform the requested seek to m_seekTimestamp
@@ -86,6 +123,9 @@ private:
 
     int m_outputWidth;
     int m_outputHeight;
+
+    std::string m_filePath;
+    int m_segmentCount = 1;
     
     bool m_requestSeek = false;
     // Timestamp in seconds of where to seek to
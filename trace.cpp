@@ -0,0 +1,160 @@
+#include "trace.h"
+
+#include "logger.h"
+#include "stats.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include <unistd.h>
+
+// Spans are stored in chunks so recording never has to
+// move what has already been recorded
+#define TRACE_CHUNK_SPANS 4096
+
+struct TraceSpan {
+    Stage stage;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+};
+
+struct TraceChunk {
+    TraceSpan spans[TRACE_CHUNK_SPANS];
+    // Spans are written before count is increased,
+    // so everything below count can be read by any thread
+    std::atomic<int> count = 0;
+    std::atomic<TraceChunk*> next = nullptr;
+};
+
+// Only ever written by its own thread, so recording takes no locks
+struct ThreadTrace {
+    pid_t tid;
+    std::string name;
+    std::atomic<bool> named = false;
+
+    TraceChunk* first;
+    TraceChunk* last;
+
+    ThreadTrace* next;
+};
+
+static std::atomic<ThreadTrace*> threads = nullptr;
+static thread_local ThreadTrace* currentThread = nullptr;
+
+static std::chrono::steady_clock::time_point startTime;
+static std::string tracePath;
+
+static ThreadTrace* thread_trace() {
+    if(currentThread) {
+        return currentThread;
+    }
+
+    ThreadTrace* thread = new ThreadTrace;
+    thread->tid = gettid();
+    thread->first = thread->last = new TraceChunk;
+
+    // Push onto the list of threads, these are never freed
+    // so the trace can be written while other threads are still running
+    thread->next = threads.load(std::memory_order_relaxed);
+    while(!threads.compare_exchange_weak(thread->next, thread, std::memory_order_release, std::memory_order_relaxed));
+
+    currentThread = thread;
+    return thread;
+}
+
+void trace_finish() {
+    // Could be interrupted while writing at exit
+    static std::once_flag written;
+    std::call_once(written, [] { trace_write(tracePath.c_str()); });
+}
+
+void trace_enable(const char* path) {
+    startTime = std::chrono::steady_clock::now();
+    tracePath = path;
+
+    traceEnabled = true;
+    trace_set_thread_name("main");
+
+    atexit(trace_finish);
+    start_signal_thread();
+}
+
+void trace_set_thread_name(const char* name) {
+    if(!traceEnabled) {
+        return;
+    }
+
+    ThreadTrace* thread = thread_trace();
+    thread->name = name;
+    thread->named.store(true, std::memory_order_release);
+}
+
+void trace_record_span(Stage stage, std::chrono::steady_clock::time_point start,
+                       std::chrono::steady_clock::time_point end) {
+    ThreadTrace* thread = thread_trace();
+    TraceChunk* chunk = thread->last;
+
+    int count = chunk->count.load(std::memory_order_relaxed);
+    if(count == TRACE_CHUNK_SPANS) {
+        TraceChunk* next = new TraceChunk;
+        chunk->next.store(next, std::memory_order_release);
+        thread->last = chunk = next;
+        count = 0;
+    }
+
+    chunk->spans[count] = {stage, start, end};
+    chunk->count.store(count + 1, std::memory_order_release);
+}
+
+static double to_trace_us(std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration<double, std::micro>(time - startTime).count();
+}
+
+int trace_write(const char* path) {
+    std::string partialPath = fmt::format("{}.tmp", path);
+    FILE* file = fopen(partialPath.c_str(), "w");
+    if(!file) {
+        Logger::Error("Failed to open '{}': {}", partialPath, strerror(errno));
+        return 1;
+    }
+
+    pid_t pid = getpid();
+    fmt::print(file, "{{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fmt::print(file, "{{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": {}, \"args\": {{\"name\": \"ttyapple\"}}}}", pid);
+
+    for(ThreadTrace* thread = threads.load(std::memory_order_acquire); thread; thread = thread->next) {
+        if(thread->named.load(std::memory_order_acquire)) {
+            fmt::print(file, ",\n{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": {}, \"tid\": {}, \"args\": {{\"name\": \"{}\"}}}}",
+                       pid, thread->tid, thread->name);
+        }
+
+        for(TraceChunk* chunk = thread->first; chunk; chunk = chunk->next.load(std::memory_order_acquire)) {
+            int count = chunk->count.load(std::memory_order_acquire);
+            for(int i = 0; i < count; i++) {
+                const TraceSpan& span = chunk->spans[i];
+                double start = to_trace_us(span.start);
+
+                fmt::print(file, ",\n{{\"name\": \"{}\", \"ph\": \"X\", \"pid\": {}, \"tid\": {}, \"ts\": {:.3f}, \"dur\": {:.3f}}}",
+                           stage_name(span.stage), pid, thread->tid, start, to_trace_us(span.end) - start);
+            }
+        }
+    }
+
+    fmt::print(file, "\n]}}\n");
+
+    bool failed = ferror(file);
+    failed |= fclose(file) != 0;
+
+    if(failed || rename(partialPath.c_str(), path)) {
+        Logger::Error("Failed to write '{}': {}", path, strerror(errno));
+        unlink(partialPath.c_str());
+        return 1;
+    }
+
+    return 0;
+}
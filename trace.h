@@ -0,0 +1,28 @@
+#pragma once
+
+#include <chrono>
+
+// Defined in stats.h
+enum class Stage;
+
+// Only set by trace_enable before any threads are started
+inline bool traceEnabled = false;
+
+// Record every timed stage as a span on the thread it ran on,
+// written to path as Chrome trace event JSON at exit or when stopped
+// by SIGINT or SIGTERM.
+// The timeline can be viewed in Perfetto or chrome://tracing.
+// Must be called before any other threads are started
+void trace_enable(const char* path);
+
+// Shown in the timeline instead of the thread ID
+void trace_set_thread_name(const char* name);
+
+void trace_record_span(Stage stage, std::chrono::steady_clock::time_point start,
+                       std::chrono::steady_clock::time_point end);
+
+// Returns 0 on success
+int trace_write(const char* path);
+// Writes the trace to the path given to trace_enable,
+// only the first call does anything
+void trace_finish();
@@ -3,6 +3,7 @@
 #include "frame.h"
 #include "logger.h"
 #include "image.h"
+#include "stats.h"
 #include "time.h"
 
 #include <cassert>
@@ -63,11 +64,19 @@ void frame_data_to_string(uint8_t* top, uint8_t* bottom, unsigned width, std::ve
     outString.push_back(0);
 }
 
-void print_frame_data(std::vector<std::vector<char>>& rows) {
-    puts("\033c");
-    for(std::vector<char> r : rows) {
-        puts(r.data());
+size_t print_frame_data(FILE* out, std::vector<std::vector<char>>& rows) {
+    fputs("\033c\n", out);
+    size_t bytes = 3;
+
+    for(const std::vector<char>& r : rows) {
+        fputs(r.data(), out);
+        fputc('\n', out);
+
+        // Newline in place of the null terminator
+        bytes += r.size();
     }
+
+    return bytes;
 }
 
 TTYOutput::TTYOutput(int width, int height)
@@ -75,13 +84,24 @@ TTYOutput::TTYOutput(int width, int height)
     m_out = stdout;
 }
 
-TTYOutput::~TTYOutput() {
-    if(m_currentFrame)
-        free_frame(m_currentFrame);
-    if(m_lastFrame)
-        free_frame(m_lastFrame);
-    if(m_nextFrame)
-        free_frame(m_nextFrame);
+int TTYOutput::set_recording(const char* path, RecordingFormat format) {
+    m_recorder = std::make_unique<Recorder>();
+
+    // An extra line for the newline after the last row
+    if(m_recorder->open(path, format, m_width, m_height / 2 + 1)) {
+        m_recorder.reset();
+        return 1;
+    }
+
+    return 0;
+}
+
+void TTYOutput::set_file(FILE* out) {
+    m_out = out;
+}
+
+void TTYOutput::set_pacing(bool enabled) {
+    m_pacing = enabled;
 }
 
 void TTYOutput::run() {
@@ -94,20 +114,20 @@ void TTYOutput::run() {
         return;
     }
 
-    m_currentFrame = m_nextFrame;
-    m_nextFrame = nullptr;
+    m_currentFrame = std::move(m_nextFrame);
 
     lock.unlock();
     m_frameCondition.notify_all();
 
-    std::vector<std::vector<char>> strings;
+    StageTimer convertTimer{Stage::Convert};
+    m_rows.resize((m_height + 1) / 2);
     for(unsigned i = 0; i < m_height; i += 2) {
-        std::vector<char> string = {};
-        frame_data_to_string(m_currentFrame->data + i * m_width, m_currentFrame->data + (i + 1) * m_width, m_width, string);
-        assert(string.back() == 0);
-
-        strings.push_back(std::move(string));
+        std::vector<char>& row = m_rows[i / 2];
+        row.clear();
+        frame_data_to_string(m_currentFrame->data + i * m_width, m_currentFrame->data + (i + 1) * m_width, m_width, row);
+        assert(row.back() == 0);
     }
+    convertTimer.stop();
 
     lock.lock();
 
@@ -116,16 +136,16 @@ void TTYOutput::run() {
     // For now just crash in this case.
     assert(!m_lastFrame);
 
-    int currentTs = m_currentFrame->usTimestamp;
-    m_lastFrame = m_currentFrame;
-    m_currentFrame = nullptr;
+    long currentTs = m_currentFrame->usTimestamp;
+    m_lastFrame = std::move(m_currentFrame);
 
     // We are done with the frame data
     lock.unlock();
     m_frameCondition.notify_all();
 
     // Sleep until it is time to draw the next frame
-    if(m_lastFrameTimestamp >= 0) {
+    StageTimer paceTimer{Stage::Pace};
+    if(m_pacing && m_lastFrameTimestamp >= 0) {
         long sleepTime = (currentTs - m_lastFrameTimestamp)
              - std::chrono::duration_cast<std::chrono::microseconds>(m_lastFrameDrawn - std::chrono::steady_clock::now()).count();
 
@@ -134,8 +154,29 @@ void TTYOutput::run() {
             usleep(sleepTime);
         }
     }
+    paceTimer.stop();
+
+    StageTimer writeTimer{Stage::Write};
+    size_t bytes;
+    if(m_recorder) {
+        // Same bytes as print_frame_data, written in one go
+        // so exactly what was shown ends up in the recording
+        m_recordBuffer = "\033c\n";
+        for(const auto& r : m_rows) {
+            m_recordBuffer.append(r.data(), r.size() - 1);
+            m_recordBuffer += '\n';
+        }
+
+        fwrite(m_recordBuffer.data(), 1, m_recordBuffer.size(), m_out);
+        m_recorder->write(currentTs, m_recordBuffer.data(), m_recordBuffer.size());
+        bytes = m_recordBuffer.size();
+    } else {
+        bytes = print_frame_data(m_out, m_rows);
+    }
+    writeTimer.stop();
 
-    print_frame_data(strings);
+    stats_add(Counter::FramesOutput);
+    stats_add(Counter::BytesWritten, bytes);
 
     m_lastFrameTimestamp = currentTs;
     m_lastFrameDrawn = std::chrono::steady_clock::now();
@@ -4,17 +4,141 @@
 #include "paths.h"
 
 #include <cassert>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 
+#include <algorithm>
+#include <filesystem>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // TODO: move unix specifics into a separate file
 #include <fcntl.h>
 #include <libgen.h>
+#include <unistd.h>
 
+#include <sys/stat.h>
 #include <sys/wait.h>
 
+// Waits for a child process, returns false if it did not exit successfully
+static bool wait_process(pid_t pid, const std::string& name) {
+    int status;
+    if(waitpid(pid, &status, 0) < 0) {
+        Logger::Error("Error waiting for '{}': {}!", name, strerror(errno));
+        return false;
+    }
+
+    if(!WIFEXITED(status)) {
+        Logger::Error("Process '{}' was terminated with status {}.", name, status);
+        return false;
+    }
+
+    if(WEXITSTATUS(status) != 0) {
+        Logger::Error("Process '{}' exited with status {}.", name, WEXITSTATUS(status));
+        return false;
+    }
+
+    return true;
+}
+
+// Reports why a forked child failed and exits it. Only async-signal-safe calls
+// are allowed in a child of a threaded process, so the logger can't be used,
+// and atexit handlers must not run as they would overwrite the parent's files
+[[noreturn]] static void child_failed(const char* what, const char* detail) {
+    // Not even strerror is safe, so write errno out as a number
+    char error[16];
+    char* p = error + sizeof(error);
+    *--p = '\0';
+    int code = errno;
+    do {
+        *--p = '0' + code % 10;
+        code /= 10;
+    } while(code && p > error);
+
+    for(const char* s : {"[terminal_apple] [Error] ", what, detail, ": errno ", (const char*)p, "\n"}) {
+        write(STDERR_FILENO, s, strlen(s));
+    }
+
+    _exit(1);
+}
+
+// Runs path with arguments and waits for it to finish,
+// returns false if it did not exit successfully
+static bool run_process(const std::string& path, const std::vector<std::string>& arguments) {
+    std::vector<char*> argv;
+    for(const auto& arg : arguments) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if(!pid) {
+        execv(path.c_str(), argv.data());
+        child_failed("Failed to execute ", path.c_str());
+    }
+
+    if(pid < 0) {
+        Logger::Error("Failed to create child process: {}!", strerror(errno));
+        return false;
+    }
+
+    return wait_process(pid, path);
+}
+
+static bool read_file(const std::string& path, std::string& contents) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if(!file) {
+        return false;
+    }
+
+    char buf[0x2000];
+    size_t result;
+    while((result = fread(buf, 1, sizeof(buf), file)) > 0) {
+        contents.append(buf, result);
+    }
+
+    bool failed = ferror(file);
+    fclose(file);
+    return !failed;
+}
+
+// Adds every header under dir to the hash, sources can include any of them
+static uint64_t hash_headers(uint64_t hash, const std::string& dir) {
+    std::vector<std::filesystem::path> headers;
+
+    std::error_code error;
+    for(auto it = std::filesystem::recursive_directory_iterator(dir, error);
+            !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+        if(it->is_regular_file() && it->path().extension() == ".h") {
+            headers.push_back(it->path());
+        }
+    }
+
+    if(error) {
+        Logger::Error("Failed to list headers in '{}': {}!", dir, error.message());
+        std::terminate();
+    }
+
+    // Directory order isn't stable
+    std::sort(headers.begin(), headers.end());
+
+    for(const auto& header : headers) {
+        std::string contents;
+        if(!read_file(header.string(), contents)) {
+            Logger::Error("Failed to read '{}': {}!", header.string(), strerror(errno));
+            std::terminate();
+        }
+
+        std::string name = header.lexically_relative(dir).string();
+        hash = hash_bytes(hash, std::string_view(name.c_str(), name.size() + 1));
+        hash = hash_bytes(hash, contents);
+    }
+
+    return hash;
+}
+
 UEFIOutput::UEFIOutput(int width, int height)
     : COutput(width, height) {
     auto paths = get_path_var();
@@ -40,178 +164,263 @@ UEFIOutput::UEFIOutput(int width, int height)
     // dirname may modify the path string so make sure to duplicate it
     char* runpath = strdup(get_run_path());
     std::string exeDir = dirname(runpath);
-    delete runpath;
+    free(runpath);
 
-    m_decodeSource = fopen((exeDir + "/data/c_frame_decoder.c").c_str(), "r");
-    if(!m_decodeSource) {
-        Logger::Debug("Error opening '{}/data/c_frame_decoder.c': {}!", exeDir, strerror(errno));
-        std::terminate();
-    }
+    m_dataDir = exeDir + "/data";
 
-    m_uefiMainSource = fopen((exeDir + "/data/uefi_main.c").c_str(), "r");
-    if(!m_uefiMainSource) {
-        Logger::Debug("Error opening '{}/data/uefi_main.c': {}!", exeDir, strerror(errno));
-        std::terminate();
+    for(const char* source : {"c_frame_decoder.c", "uefi_main.c"}) {
+        if(access((m_dataDir + "/" + source).c_str(), R_OK)) {
+            Logger::Error("Error opening '{}/{}': {}!", m_dataDir, source, strerror(errno));
+            std::terminate();
+        }
     }
 
-    if(pipe(m_pipe)) {
-        Logger::Error("Failed to create pipe: {}!", strerror(errno));
-        std::terminate();
+    m_compileFlags = {
+        "-target", "x86_64-unknown-windows",
+        "-DMDE_CPU_X64", "-DUEFI",
+        "-I" + m_dataDir + "/uefi",
+        "-Wno-microsoft-static-assert",
+        "-ffreestanding", "-mno-red-zone",
+    };
+
+    // The decoder and entry point are built separately and cached,
+    // only the frame data gets compiled every run
+    m_separateDecoder = true;
+}
+
+void UEFIOutput::set_output_file(const char* path) {
+    m_outputPath = path;
+}
+
+void UEFIOutput::set_framebuffer(bool enabled) {
+    assert(!m_frameIndex);
+
+    // Both the decoder and entry point need to know,
+    // the flag also keeps them apart in the build cache
+    if(enabled) {
+        m_compileFlags.push_back("-DUSE_FRAMEBUFFER");
     }
+}
+
+void UEFIOutput::set_shard_count(int count) {
+    assert(!m_frameIndex && count > 0);
+    m_shardCount = count;
+}
 
-    if(fcntl(m_pipe[1], F_SETFD, FD_CLOEXEC)) {
-        Logger::Error("Failed to set cloexec on pipe: {}!", strerror(errno));
+FILE* UEFIOutput::start_compiler(const std::string& object, pid_t& pid) {
+    // Both ends are cloexec so other compilers don't hold on to them,
+    // otherwise they would never see the end of their input
+    int fds[2];
+    if(pipe2(fds, O_CLOEXEC)) {
+        Logger::Error("Failed to create pipe: {}!", strerror(errno));
         std::terminate();
     }
 
-    m_out = fdopen(m_pipe[1], "wb");
-    if(!m_out) {
+    FILE* out = fdopen(fds[1], "wb");
+    if(!out) {
         Logger::Debug("fdopen: {}!", strerror(errno));
         std::terminate();
     }
 
-    std::vector<char*> clangArguments;
-    clangArguments.push_back(strdup(m_compiler.c_str()));
-    clangArguments.push_back(strdup("-target"));
-    clangArguments.push_back(strdup("x86_64-unknown-windows"));
-    clangArguments.push_back(strdup("-c"));
+    std::vector<std::string> clangArguments = {m_compiler, "-c"};
     // Read from stdin
-    clangArguments.push_back(strdup("-x"));
-    clangArguments.push_back(strdup("c"));
-    clangArguments.push_back(strdup("-"));
-    // Defines
-    clangArguments.push_back(strdup("-DMDE_CPU_X64"));
-    clangArguments.push_back(strdup("-DUEFI"));
-
-    std::string uefiIncludeDir = "-I" + exeDir + "/data/uefi";
-    clangArguments.push_back(strdup(uefiIncludeDir.c_str()));
-
-    clangArguments.push_back(strdup("-Wno-microsoft-static-assert"));
-
-    clangArguments.push_back(strdup("-ffreestanding"));
-    clangArguments.push_back(strdup("-mno-red-zone"));
-    clangArguments.push_back(strdup("-o"));
-    clangArguments.push_back(strdup("frames.o"));
-    clangArguments.push_back(nullptr);
-
-    m_compilerPID = fork();
-    if(!m_compilerPID) {
-        if(dup2(m_pipe[0], STDIN_FILENO)) {
-            Logger::Debug("dup2: {}!", strerror(errno));
-            exit(1);
-        }
+    clangArguments.insert(clangArguments.end(), {"-x", "c", "-"});
+    clangArguments.insert(clangArguments.end(), m_compileFlags.begin(), m_compileFlags.end());
+    clangArguments.insert(clangArguments.end(), {"-o", object});
 
-        if(execv(m_compiler.c_str(), clangArguments.data())) {
-            Logger::Debug("Failed to execute {}: {}!", m_compiler.c_str(), strerror(errno));
-        }
-        exit(1);
+    std::vector<char*> argv;
+    for(const auto& arg : clangArguments) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
     }
+    argv.push_back(nullptr);
 
-    for(char* arg : clangArguments) {
-        free(arg);
+    pid = fork();
+    if(!pid) {
+        if(dup2(fds[0], STDIN_FILENO) < 0) {
+            child_failed("dup2", "");
+        }
+
+        execv(m_compiler.c_str(), argv.data());
+        child_failed("Failed to execute ", m_compiler.c_str());
     }
 
-    if(m_compilerPID < 0) {
+    if(pid < 0) {
         Logger::Error("Failed to create child process: {}!", strerror(errno));
         std::terminate();
     }
 
-    fprintf(m_out, "#include <stdint.h>\n");
+    close(fds[0]);
+    return out;
 }
 
-void UEFIOutput::set_output_file(const char* path) {
-    m_outputPath = path;
-}
+CWriter& UEFIOutput::frame_writer(int index) {
+    unsigned shard = index % m_shardCount;
 
-void UEFIOutput::finish() {
-    COutput::finish();
+    // Start compilers as they are needed,
+    // so there aren't any for short videos or blob storage
+    while(m_shards.size() <= shard) {
+        auto frameShard = std::make_unique<FrameShard>();
+        frameShard->object = fmt::format("frames{}.o", m_shards.size());
+        frameShard->out = start_compiler(frameShard->object, frameShard->compilerPID);
 
-    char buf[0x2000];
-    size_t result;
-    while((result = fread(buf, 1, 0x2000, m_decodeSource)) > 0) {
-        if(fwrite(buf, 1, result, m_out) != result) {
-            // Likely encountered some error
-            break;
-        }
-    }
+        frameShard->writer.set_file(frameShard->out);
+        frameShard->writer.write("#include <stdint.h>\n");
 
-    if(ferror(m_decodeSource)) {
-        Logger::Error("Failed to read c_decode_frames.c: {}!", strerror(errno));
+        m_shards.push_back(std::move(frameShard));
     }
 
-    if(ferror(m_out)) {
-        Logger::Error("Failed to write to pipe: {}!", strerror(errno));
+    return m_shards[shard]->writer;
+}
+
+std::string UEFIOutput::cached_object(const std::string& source, const std::vector<std::string>& flags) {
+    std::string contents;
+    if(!read_file(source, contents)) {
+        Logger::Error("Failed to read '{}': {}!", source, strerror(errno));
+        std::terminate();
     }
 
-    while((result = fread(buf, 1, 0x2000, m_uefiMainSource)) > 0) {
-        if(fwrite(buf, 1, result, m_out) != result) {
-            // Likely encountered some error
-            break;
-        }
+    // Key on everything that goes into the object
+    uint64_t hash = hash_bytes(HASH_BYTES_INITIAL, m_compiler);
+
+    // Upgrading the compiler usually keeps the same path, so go by the
+    // binary itself (stat follows the usual clang -> clang-N symlinks)
+    struct stat st;
+    if(stat(m_compiler.c_str(), &st)) {
+        Logger::Error("Failed to stat '{}': {}!", m_compiler, strerror(errno));
+        std::terminate();
     }
 
-    if(ferror(m_uefiMainSource)) {
-        Logger::Error("Failed to read uefi_main.c: {}!", strerror(errno));
+    int64_t compilerId[] = {(int64_t)st.st_dev, (int64_t)st.st_ino, (int64_t)st.st_size,
+            (int64_t)st.st_mtim.tv_sec, (int64_t)st.st_mtim.tv_nsec};
+    hash = hash_bytes(hash, std::string_view((const char*)compilerId, sizeof(compilerId)));
+    for(const auto& flag : flags) {
+        // Include the terminator so flags can't run into each other
+        hash = hash_bytes(hash, std::string_view(flag.c_str(), flag.size() + 1));
+    }
+    hash = hash_bytes(hash, contents);
+    hash = hash_headers(hash, m_dataDir);
+
+    // Fall back to the working directory if there is no cache,
+    // the objects are still reused from there
+    std::string cacheDir = get_cache_dir();
+    if(cacheDir.empty()) {
+        cacheDir = ".";
     }
 
-    if(ferror(m_out)) {
-        Logger::Error("Failed to write to pipe: {}!", strerror(errno));
+    std::string object = fmt::format("{}/{}-{:016x}.o", cacheDir,
+            std::filesystem::path(source).stem().string(), hash);
+    if(access(object.c_str(), R_OK) == 0) {
+        Logger::Debug("Using cached {}", object);
+        return object;
     }
 
-    fclose(m_out);
+    // Build under another name and rename it into place so other
+    // instances never see a partially written object
+    std::string partial = fmt::format("{}.{}.tmp", object, getpid());
 
-    m_out = nullptr;
+    std::vector<std::string> clangArguments = {m_compiler, "-c", source};
+    clangArguments.insert(clangArguments.end(), flags.begin(), flags.end());
+    clangArguments.insert(clangArguments.end(), {"-o", partial});
 
-    int status;
-    if(waitpid(-1, &status, 0) < 0) {
-        Logger::Error("Error waiting for '{}': {}!", m_compiler, strerror(errno));
+    Logger::Debug("Compiling {}", object);
+    if(!run_process(m_compiler, clangArguments)) {
+        unlink(partial.c_str());
         std::terminate();
     }
 
-    if(!WIFEXITED(status)) {
-        Logger::Error("Process '{}' was terminated with status {}.", m_compiler, status);
+    if(rename(partial.c_str(), object.c_str())) {
+        Logger::Error("Failed to rename '{}' to '{}': {}!", partial, object, strerror(errno));
+        unlink(partial.c_str());
         std::terminate();
     }
 
-    if(WEXITSTATUS(status) != 0) {
-        Logger::Error("Process '{}' exited with status {}.", m_compiler, WEXITSTATUS(status));
-        std::terminate();
-    }
+    return object;
+}
+
+void UEFIOutput::finish() {
+    std::string framesObject;
+    if(m_storage == FrameStorage::Object) {
+        // Everything is written straight to the object
+        COutput::finish();
+        framesObject = m_blobPath;
+    } else {
+        // Frame arrays go to the shards, so nothing is generated
+        // here until finish and the compiler can start now
+        framesObject = "frames.o";
+        m_out = start_compiler(framesObject, m_compilerPID);
+
+        m_writer.set_file(m_out);
+        m_writer.write("#include <stdint.h>\n");
+
+        COutput::finish();
+
+        if(ferror(m_out)) {
+            Logger::Error("Failed to write to pipe: {}!", strerror(errno));
+        }
 
-    std::vector<char*> lldArguments;
-    lldArguments.push_back(strdup("lld-link"));
-    lldArguments.push_back(strdup("-subsystem:efi_application"));
-    lldArguments.push_back(strdup("-entry:efi_main"));
-    lldArguments.push_back(strdup("-out:output.efi"));
-    lldArguments.push_back(strdup("frames.o"));
-    lldArguments.push_back(nullptr);
+        fclose(m_out);
 
-    m_compilerPID = fork();
-    if(!m_compilerPID) {
-        if(execv(m_linker.c_str(), lldArguments.data())) {
-            Logger::Debug("Failed to execute {}: {}!", m_linker.c_str(), strerror(errno));
+        m_out = nullptr;
+
+        for(auto& shard : m_shards) {
+            shard->writer.flush();
+            if(fclose(shard->out)) {
+                Logger::Error("Failed to write to pipe: {}!", strerror(errno));
+            }
+        }
+
+        // Wait for everything even if one fails so none are left behind
+        bool compiled = wait_process(m_compilerPID, m_compiler);
+        for(auto& shard : m_shards) {
+            compiled &= wait_process(shard->compilerPID, m_compiler);
+        }
+
+        if(!compiled) {
+            std::terminate();
+        }
+
+        // The frame data is now in frames.o
+        if(m_storage != FrameStorage::Array) {
+            unlink(m_blobPath.c_str());
         }
-        exit(1);
     }
 
-    for(char* arg : lldArguments) {
-        free(arg);
+    // The decoder only depends on the frame dimensions and encoding
+    std::vector<std::string> decoderFlags = m_compileFlags;
+    decoderFlags.push_back("-DSEPARATE_FRAME_DATA");
+    for(const auto& [name, value] : decoder_defines()) {
+        if(value.empty()) {
+            decoderFlags.push_back("-D" + name);
+        } else {
+            decoderFlags.push_back("-D" + name + "=" + value);
+        }
     }
 
-    if(waitpid(-1, &status, 0) < 0) {
-        Logger::Error("Error waiting for '{}': {}!", m_linker, strerror(errno));
-        std::terminate();
+    std::string decoderObject = cached_object(m_dataDir + "/c_frame_decoder.c", decoderFlags);
+    std::string mainObject = cached_object(m_dataDir + "/uefi_main.c", m_compileFlags);
+
+    std::vector<std::string> lldArguments = {
+        "lld-link",
+        "-subsystem:efi_application",
+        "-entry:efi_main",
+        "-out:output.efi",
+        framesObject,
+        decoderObject,
+        mainObject,
+    };
+
+    for(const auto& shard : m_shards) {
+        lldArguments.push_back(shard->object);
     }
 
-    unlink("frames.o");
+    bool linked = run_process(m_linker, lldArguments);
 
-    if(!WIFEXITED(status)) {
-        Logger::Error("Process '{}' was terminated with status {}.", m_linker, status);
-        std::terminate();
+    unlink(framesObject.c_str());
+    for(const auto& shard : m_shards) {
+        unlink(shard->object.c_str());
     }
 
-    if(WEXITSTATUS(status) != 0) {
-        Logger::Error("Process '{}' exited with status {}.", m_linker, WEXITSTATUS(status));
+    if(!linked) {
         std::terminate();
     }
 }